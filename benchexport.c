@@ -0,0 +1,647 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Capacity sweep for the export path, against the hsmsim stand-in for
+ * the hardserver, so it runs on any Linux box.  For every combination
+ * of worker count, in-flight depth, key type and output mode it
+ * exports a number of keys and writes one CSV row with keys/s,
+ * per-phase latency percentiles, peak RSS and CPU time.
+ *
+ * Each worker has its own connection to the stand-in and keeps up to
+ * depth requests outstanding on it.  For every reply it turns the
+ * public values into BIGNUMs (as the nCore upcalls do), makes the tag,
+ * builds the key, encodes it and, in file mode, writes it out.  Each
+ * configuration runs in a child process of its own, so that peak RSS
+ * and CPU time are for that configuration alone; the stand-in runs in
+ * yet another process and is not counted.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+
+#include "hsmsim.h"
+#include "keybuild.h"
+#include "keytag.h"
+
+enum bench_phase {
+  PHASE_HSM = 0,  /* Request sent until reply received */
+  PHASE_BUILD,    /* BIGNUMs, tag and EVP_PKEY */
+  PHASE_ENCODE,   /* To every output format, in memory */
+  PHASE_WRITE,    /* To a file, in file mode */
+  NPHASES
+};
+
+static const char *phasenames[NPHASES] = { "hsm", "build", "encode", "write" };
+
+enum bench_mode {
+  MODE_NULL = 0,  /* Encode, then throw away */
+  MODE_FILE,      /* Encode and write a file per key and format */
+  NMODES
+};
+
+static const char *modenames[NMODES] = { "null", "file" };
+
+#define MAXLIST 32
+
+struct sweep {
+  int workers[MAXLIST], nworkers;
+  int depths[MAXLIST], ndepths;
+  int keytypes[MAXLIST], nkeytypes;
+  int modes[MAXLIST], nmodes;
+  int nkeys;
+  unsigned int formats;  /* KEYBUILD_FORMAT_BITs */
+  /* The same as enum keybuild_formats, in the order given */
+  int formatorder[KEYBUILD_NFORMATS], nformatorder;
+  const char *label;
+  const char *socket;
+  const char *outdir;
+};
+
+/* One configuration */
+struct run {
+  const struct sweep *sweep;
+  int keytype, nworkers, depth, mode;
+  pthread_mutex_t lock;  /* Protects the two below */
+  int next;              /* Next key to request */
+  int failed;
+  double *sendtime;      /* Per key */
+  double *samples[NPHASES]; /* Per key, in seconds; negative if the key
+			       did not get through that phase */
+};
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int claim_key(struct run *run)
+{
+  int key;
+
+  pthread_mutex_lock(&run->lock);
+  key = run->next < run->sweep->nkeys ? run->next++ : -1;
+  pthread_mutex_unlock(&run->lock);
+  return key;
+}
+
+static void count_failure(struct run *run)
+{
+  pthread_mutex_lock(&run->lock);
+  run->failed++;
+  pthread_mutex_unlock(&run->lock);
+}
+
+/* The part of export_key() after the HSM has answered */
+static EVP_PKEY *build_key(struct keybuild_ctx *kb,
+			   const struct hsmsim_reply *reply)
+{
+  BIGNUM *vals[HSMSIM_MAXVALS] = { NULL, NULL, NULL, NULL };
+  unsigned char tagbuf[HSMSIM_MAXDATA];
+  BIGNUM *tag = NULL;
+  EVP_PKEY *pkey = NULL;
+  int taglen, version, tagtype;
+  uint32_t i;
+
+  for (i = 0; i < reply->nvals; i++)
+    if ((vals[i] = BN_bin2bn(reply->vals[i], reply->lens[i], NULL)) == NULL)
+      goto done;
+
+  switch (reply->keytype) {
+  case HSMSIM_RSA2048:
+  case HSMSIM_RSA4096:
+  case HSMSIM_RSA8192:
+    taglen = reply->bits / 16;
+    tagtype = KEYTAG_KEY_RSA;
+    break;
+  case HSMSIM_DSA2048:
+    taglen = reply->bits / 8;
+    tagtype = KEYTAG_KEY_DSA;
+    break;
+  default:
+    taglen = (reply->bits + 7) / 8;
+    tagtype = KEYTAG_KEY_EC;
+    break;
+  }
+  version = taglen >= KEYTAG_V1_MINLEN ? KEYTAG_V1 : KEYTAG_V2;
+  if (keytag_encode(tagbuf, taglen, version, tagtype,
+		    reply->hash) != 0)
+    goto done;
+  if ((tag = BN_bin2bn(tagbuf, taglen, NULL)) == NULL) goto done;
+
+  switch (reply->keytype) {
+  case HSMSIM_RSA2048:
+  case HSMSIM_RSA4096:
+  case HSMSIM_RSA8192:
+    pkey = keybuild_rsa(kb, vals[0], vals[1], tag);
+    break;
+  case HSMSIM_DSA2048:
+    pkey = keybuild_dsa(kb, vals[0], vals[1], vals[2], vals[3], tag);
+    break;
+  default:
+    pkey = keybuild_ec(kb, reply->nid, vals[0], vals[1], tag);
+    break;
+  }
+
+ done:
+  for (i = 0; i < HSMSIM_MAXVALS; i++)
+    BN_free(vals[i]);
+  BN_free(tag);
+  return pkey;
+}
+
+static int write_key(const struct run *run, int key,
+		     const struct keybuild_encoded *enc)
+{
+  char path[4096];
+  FILE *f;
+  int i, rc = 0;
+
+  for (i = 0; i < KEYBUILD_NFORMATS; i++) {
+    if (!enc->data[i]) continue;
+    snprintf(path, sizeof(path), "%s/key-%d%s", run->sweep->outdir, key,
+	     keybuild_format_suffix(i));
+    f = fopen(path, "w");
+    if (f == NULL) return -1;
+    if (fwrite(enc->data[i], 1, enc->len[i], f) != enc->len[i]) rc = -1;
+    if (fclose(f) != 0) rc = -1;
+  }
+  return rc;
+}
+
+/* The formats actually encoded for the keys of a run */
+static unsigned int run_formats(const struct run *run)
+{
+  unsigned int formats = run->sweep->formats;
+
+  /* There is no such thing as a DSA JWK */
+  if (run->keytype == HSMSIM_DSA2048)
+    formats &= ~KEYBUILD_FORMAT_BIT(KEYBUILD_JWK);
+  return formats;
+}
+
+/* Names of formats, joined with "+", for the CSV */
+static void format_names(const struct sweep *sweep, unsigned int formats,
+			 char *buf, size_t size)
+{
+  int i, f;
+
+  buf[0] = '\0';
+  for (i = 0; i < sweep->nformatorder; i++) {
+    f = sweep->formatorder[i];
+    if (!(formats & KEYBUILD_FORMAT_BIT(f))) continue;
+    if (buf[0])
+      strncat(buf, "+", size - strlen(buf) - 1);
+    strncat(buf, keybuild_format_name(f), size - strlen(buf) - 1);
+  }
+}
+
+static void *bench_worker(void *arg)
+{
+  struct run *run = (struct run *)arg;
+  struct hsmsim_reply *reply;
+  struct keybuild_ctx *kb;
+  struct keybuild_encoded enc;
+  unsigned int formats = run_formats(run);
+  EVP_PKEY *pkey;
+  int fd, inflight = 0, key, status;
+  double t0, t1;
+
+  reply = malloc(sizeof(*reply));
+  kb = keybuild_ctx_new();
+  fd = hsmsim_connect(run->sweep->socket);
+  if (reply == NULL || kb == NULL || fd < 0) {
+    fprintf(stderr, "Error setting up worker\n");
+    while (claim_key(run) >= 0)
+      count_failure(run);
+    goto done;
+  }
+
+  for (;;) {
+    /* Keep the pipe full */
+    while (inflight < run->depth && (key = claim_key(run)) >= 0) {
+      run->sendtime[key] = now();
+      if (hsmsim_send(fd, key, run->keytype, key) != 0) {
+	count_failure(run);
+	continue;
+      }
+      inflight++;
+    }
+    if (inflight == 0) break;
+
+    if (hsmsim_recv(fd, reply) != 0) {
+      fprintf(stderr, "Lost connection to the hardserver stand-in\n");
+      while (inflight-- > 0)
+	count_failure(run);
+      break;
+    }
+    inflight--;
+    key = reply->id;
+    t0 = now();
+    run->samples[PHASE_HSM][key] = t0 - run->sendtime[key];
+
+    pkey = build_key(kb, reply);
+    t1 = now();
+    if (pkey == NULL) {
+      count_failure(run);
+      continue;
+    }
+    run->samples[PHASE_BUILD][key] = t1 - t0;
+
+    t0 = t1;
+    status = keybuild_encode(kb, pkey, formats, &enc);
+    EVP_PKEY_free(pkey);
+    t1 = now();
+    if (status == 0) {
+      count_failure(run);
+      continue;
+    }
+    run->samples[PHASE_ENCODE][key] = t1 - t0;
+
+    if (run->mode == MODE_FILE) {
+      t0 = t1;
+      if (write_key(run, key, &enc) != 0)
+	count_failure(run);
+      else
+	run->samples[PHASE_WRITE][key] = now() - t0;
+    }
+  }
+
+ done:
+  if (fd >= 0) close(fd);
+  keybuild_ctx_free(kb);
+  free(reply);
+  ERR_clear_error();
+  return NULL;
+}
+
+static int cmpdouble(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Move the samples taken to the front of the array and return how
+   many there are */
+static int compact_samples(double *samples, int n)
+{
+  int i, taken = 0;
+
+  for (i = 0; i < n; i++)
+    if (samples[i] >= 0)
+      samples[taken++] = samples[i];
+  return taken;
+}
+
+/* Nearest-rank percentile of a sorted array, in microseconds */
+static double percentile(const double *sorted, int n, int pct)
+{
+  int rank;
+
+  if (n == 0) return 0;
+  rank = (pct * n + 99) / 100;
+  if (rank < 1) rank = 1;
+  return 1e6 * sorted[rank - 1];
+}
+
+/* Runs in the child: do one configuration and write its CSV fields,
+   less the resource usage, to out. */
+static int run_config(struct run *run, FILE *out)
+{
+  pthread_t *threads;
+  double start, elapsed;
+  char formatnames[64];
+  int nkeys = run->sweep->nkeys;
+  int i, j, started, nsamples;
+
+  pthread_mutex_init(&run->lock, NULL);
+  run->next = 0;
+  run->failed = 0;
+  run->sendtime = calloc(nkeys, sizeof(double));
+  for (i = 0; i < NPHASES; i++)
+    run->samples[i] = calloc(nkeys, sizeof(double));
+  threads = calloc(run->nworkers, sizeof(*threads));
+  if (run->sendtime == NULL || threads == NULL) return -1;
+  for (i = 0; i < NPHASES; i++) {
+    if (run->samples[i] == NULL) return -1;
+    for (j = 0; j < nkeys; j++)
+      run->samples[i][j] = -1;
+  }
+
+  start = now();
+  for (started = 0; started < run->nworkers; started++)
+    if (pthread_create(&threads[started], NULL, bench_worker, run) != 0)
+      break;
+  if (started == 0) bench_worker(run);
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  elapsed = now() - start;
+
+  format_names(run->sweep, run_formats(run), formatnames,
+	       sizeof(formatnames));
+  fprintf(out, "%s,%s,%d,%d,%s,%s,%d,%d,%.6f,%.1f",
+	  run->sweep->label, hsmsim_keytype_name(run->keytype),
+	  run->nworkers, run->depth, modenames[run->mode],
+	  formatnames,
+	  nkeys, run->failed, elapsed, (nkeys - run->failed) / elapsed);
+  /* Keys that failed in or before a phase don't count towards its
+     percentiles */
+  for (i = 0; i < NPHASES; i++) {
+    /* Nothing is written in null mode: leave the fields empty rather
+       than report zero latency */
+    if (i == PHASE_WRITE && run->mode != MODE_FILE) {
+      fprintf(out, ",,,");
+      continue;
+    }
+    nsamples = compact_samples(run->samples[i], nkeys);
+    qsort(run->samples[i], nsamples, sizeof(double), cmpdouble);
+    fprintf(out, ",%.1f,%.1f,%.1f",
+	    percentile(run->samples[i], nsamples, 50),
+	    percentile(run->samples[i], nsamples, 95),
+	    percentile(run->samples[i], nsamples, 99));
+  }
+  return run->failed ? 1 : 0;
+}
+
+/* Fork a child for one configuration and complete its CSV row with
+   the child's peak RSS and CPU time. */
+static int sweep_one(const struct sweep *sweep, int keytype, int nworkers,
+		     int depth, int mode, FILE *csv)
+{
+  struct run run;
+  struct rusage ru;
+  char line[1024];
+  int fds[2], status;
+  ssize_t n;
+  size_t len = 0;
+  FILE *out;
+  pid_t pid;
+
+  if (pipe(fds) != 0) return -1;
+  fflush(csv);
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) {
+    close(fds[0]);
+    out = fdopen(fds[1], "w");
+    memset(&run, 0, sizeof(run));
+    run.sweep = sweep;
+    run.keytype = keytype;
+    run.nworkers = nworkers;
+    run.depth = depth;
+    run.mode = mode;
+    status = out ? run_config(&run, out) : -1;
+    if (out) fclose(out);
+    _exit(status < 0 ? 2 : status);
+  }
+
+  close(fds[1]);
+  while (len < sizeof(line) - 1
+	 && (n = read(fds[0], line + len, sizeof(line) - 1 - len)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    len += n;
+  }
+  line[len] = '\0';
+  close(fds[0]);
+  if (wait4(pid, &status, 0, &ru) != pid) return -1;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) == 2 || len == 0) {
+    fprintf(stderr, "Configuration %s/%d workers/depth %d/%s failed\n",
+	    hsmsim_keytype_name(keytype), nworkers, depth, modenames[mode]);
+    return -1;
+  }
+
+  /* ru_maxrss is in kilobytes on Linux */
+  fprintf(csv, "%s,%ld,%.3f,%.3f\n", line, ru.ru_maxrss,
+	  ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+	  ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+  fflush(csv);
+  return WEXITSTATUS(status);
+}
+
+static void write_header(FILE *csv)
+{
+  int i;
+
+  fprintf(csv, "label,keytype,workers,depth,mode,formats,keys,failed,seconds,"
+	  "keys_per_s");
+  for (i = 0; i < NPHASES; i++)
+    fprintf(csv, ",%s_p50_us,%s_p95_us,%s_p99_us",
+	    phasenames[i], phasenames[i], phasenames[i]);
+  fprintf(csv, ",peak_rss_kb,cpu_user_s,cpu_sys_s\n");
+}
+
+/* Parse a comma separated list with parse(), which returns < 0 for
+   an invalid item. */
+static int parse_list(const char *arg, int *list, int *n,
+		      int (*parse)(const char *))
+{
+  char *copy, *item, *save = NULL;
+  int value;
+
+  copy = strdup(arg);
+  if (copy == NULL) return -1;
+  *n = 0;
+  for (item = strtok_r(copy, ",", &save); item;
+       item = strtok_r(NULL, ",", &save)) {
+    value = parse(item);
+    if (value < 0 || *n == MAXLIST) {
+      fprintf(stderr, "Invalid list item: %s\n", item);
+      free(copy);
+      return -1;
+    }
+    list[(*n)++] = value;
+  }
+  free(copy);
+  return *n > 0 ? 0 : -1;
+}
+
+static int parse_positive(const char *s)
+{
+  int value = atoi(s);
+
+  return value > 0 ? value : -1;
+}
+
+static int parse_mode(const char *s)
+{
+  int i;
+
+  for (i = 0; i < NMODES; i++)
+    if (strcmp(modenames[i], s) == 0) return i;
+  return -1;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+	  "Usage: %s [-o results.csv [-a]] [-n keys] [-w workers,...]"
+	  " [-d depth,...]\n"
+	  "       [-k keytype,...] [-m mode,...] [-l latency_us]"
+	  " [-c cores] [-L label]\n"
+	  "       [-f format,...] [-t tmpdir]\n"
+	  "Key types: rsa2048 rsa4096 rsa8192 dsa2048 p256 p384\n"
+	  "Modes: null file\n"
+	  "Formats: pkcs8 pem der spki jwk\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+  struct sweep sweep;
+  struct hsmsim_config sim;
+  const char *csvname = NULL, *tmpdir = "/tmp";
+  char outdir[256], socketpath[300], path[300];
+  FILE *csv = stdout;
+  int formats[MAXLIST], nformats = 0;
+  int append = 0, failed = 0;
+  int w, d, k, m, f, i, opt;
+  pid_t simpid;
+
+  memset(&sweep, 0, sizeof(sweep));
+  parse_list("1,2,4,8", sweep.workers, &sweep.nworkers, parse_positive);
+  parse_list("1,4", sweep.depths, &sweep.ndepths, parse_positive);
+  parse_list("rsa2048,rsa4096,rsa8192,dsa2048,p256,p384", sweep.keytypes,
+	     &sweep.nkeytypes, hsmsim_keytype_byname);
+  parse_list("null,file", sweep.modes, &sweep.nmodes, parse_mode);
+  sweep.nkeys = 200;
+  sweep.label = OpenSSL_version(OPENSSL_VERSION);
+  memset(&sim, 0, sizeof(sim));
+  sim.latency_us = 1000;
+  sim.cores = 8;
+  sim.nfixtures = 16;
+
+  while ((opt = getopt(argc, argv, "o:an:w:d:k:m:l:c:L:f:t:")) != -1) {
+    switch (opt) {
+    case 'o': csvname = optarg; break;
+    case 'a': append = 1; break;
+    case 'n': sweep.nkeys = parse_positive(optarg); break;
+    case 'w':
+      if (parse_list(optarg, sweep.workers, &sweep.nworkers,
+		     parse_positive)) return 1;
+      break;
+    case 'd':
+      if (parse_list(optarg, sweep.depths, &sweep.ndepths,
+		     parse_positive)) return 1;
+      break;
+    case 'k':
+      if (parse_list(optarg, sweep.keytypes, &sweep.nkeytypes,
+		     hsmsim_keytype_byname)) return 1;
+      break;
+    case 'm':
+      if (parse_list(optarg, sweep.modes, &sweep.nmodes, parse_mode))
+	return 1;
+      break;
+    case 'l': sim.latency_us = atoi(optarg); break;
+    case 'c': sim.cores = atoi(optarg); break;
+    case 'L': sweep.label = optarg; break;
+    case 'f':
+      if (parse_list(optarg, formats, &nformats, keybuild_format_byname))
+	return 1;
+      break;
+    case 't': tmpdir = optarg; break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc || sweep.nkeys <= 0 || sim.latency_us < 0
+      || sim.cores < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  /* PKCS#8 PEM, as key-reference writes by default */
+  if (nformats == 0) formats[nformats++] = KEYBUILD_PKCS8_PEM;
+  for (f = 0; f < nformats; f++) {
+    if (sweep.formats & KEYBUILD_FORMAT_BIT(formats[f])) continue;
+    sweep.formats |= KEYBUILD_FORMAT_BIT(formats[f]);
+    sweep.formatorder[sweep.nformatorder++] = formats[f];
+  }
+
+  if (csvname) {
+    csv = fopen(csvname, append ? "a" : "w");
+    if (csv == NULL) {
+      fprintf(stderr, "Error opening %s: %s\n", csvname, strerror(errno));
+      return 1;
+    }
+  }
+  if (!append)
+    write_header(csv);
+
+  snprintf(outdir, sizeof(outdir), "%s/benchexport.XXXXXX", tmpdir);
+  if (mkdtemp(outdir) == NULL) {
+    fprintf(stderr, "Error creating %s: %s\n", outdir, strerror(errno));
+    return 1;
+  }
+  snprintf(socketpath, sizeof(socketpath), "%s/hardserver", outdir);
+  sweep.outdir = outdir;
+  sweep.socket = socketpath;
+  sim.path = socketpath;
+
+  simpid = hsmsim_spawn(&sim);
+  if (simpid < 0) {
+    fprintf(stderr, "Error starting the hardserver stand-in\n");
+    rmdir(outdir);
+    return 1;
+  }
+
+  for (k = 0; k < sweep.nkeytypes; k++)
+    for (m = 0; m < sweep.nmodes; m++)
+      for (w = 0; w < sweep.nworkers; w++)
+	for (d = 0; d < sweep.ndepths; d++)
+	  if (sweep_one(&sweep, sweep.keytypes[k], sweep.workers[w],
+			sweep.depths[d], sweep.modes[m], csv) != 0)
+	    failed = 1;
+
+  hsmsim_stop(simpid);
+  unlink(socketpath);
+  for (i = 0; i < sweep.nkeys; i++)
+    for (f = 0; f < KEYBUILD_NFORMATS; f++) {
+      snprintf(path, sizeof(path), "%s/key-%d%s", outdir, i,
+	       keybuild_format_suffix(f));
+      unlink(path);
+    }
+  rmdir(outdir);
+  if (csv != stdout) fclose(csv);
+
+  return failed;
+}
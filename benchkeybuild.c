@@ -0,0 +1,183 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Compare keys/second for the legacy and OpenSSL 3 (fromdata) key
+ * construction methods.  The public values are synthetic BIGNUMs
+ * standing in for the ones the nCore upcalls hand us, and are passed
+ * to both methods as is.
+ * Each iteration builds the reference key and writes it as PKCS#8 PEM
+ * to a memory BIO.
+ *
+ *   benchkeybuild [iterations]
+ */
+
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <openssl/ec.h>
+#include <openssl/err.h>
+#include <openssl/obj_mac.h>
+
+#include "keybuild.h"
+
+struct benchkeys {
+  BIGNUM *rsa_n, *rsa_e, *rsa_tag;
+  BIGNUM *dsa_p, *dsa_q, *dsa_g, *dsa_y, *dsa_tag;
+  BIGNUM *ec_x, *ec_y, *ec_tag;
+};
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static BIGNUM *randbn(int bits)
+{
+  BIGNUM *bn = BN_new();
+
+  if (bn == NULL || !BN_rand(bn, bits, BN_RAND_TOP_ONE, BN_RAND_BOTTOM_ODD)) {
+    fprintf(stderr, "Error generating synthetic BIGNUM\n");
+    exit(1);
+  }
+  return bn;
+}
+
+static void make_benchkeys(struct benchkeys *k)
+{
+  EC_GROUP *group;
+
+  k->rsa_n = randbn(2048);
+  k->rsa_e = BN_new();
+  BN_set_word(k->rsa_e, 65537);
+  k->rsa_tag = randbn(1024);
+
+  k->dsa_p = randbn(2048);
+  k->dsa_q = randbn(256);
+  k->dsa_g = randbn(2047);
+  k->dsa_y = randbn(2047);
+  k->dsa_tag = randbn(2048);
+
+  /* The legacy path checks that the public point is on the curve, so
+     use the generator. */
+  group = EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1);
+  k->ec_x = BN_new();
+  k->ec_y = BN_new();
+  if (group == NULL
+      || !EC_POINT_get_affine_coordinates(group, EC_GROUP_get0_generator(group),
+					  k->ec_x, k->ec_y, NULL)) {
+    fprintf(stderr, "Error obtaining P-256 generator\n");
+    exit(1);
+  }
+  EC_GROUP_free(group);
+  k->ec_tag = randbn(255);
+}
+
+static EVP_PKEY *build(struct keybuild_ctx *kb, struct benchkeys *k,
+		       enum keybuild_type type)
+{
+  switch (type) {
+  case KEYBUILD_RSA:
+    return keybuild_rsa(kb, k->rsa_n, k->rsa_e, k->rsa_tag);
+  case KEYBUILD_DSA:
+    return keybuild_dsa(kb, k->dsa_p, k->dsa_q, k->dsa_g, k->dsa_y,
+			k->dsa_tag);
+  case KEYBUILD_EC:
+    return keybuild_ec(kb, NID_X9_62_prime256v1, k->ec_x, k->ec_y,
+		       k->ec_tag);
+  default:
+    return NULL;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  static const char *typenames[KEYBUILD_NTYPES] = { "RSA-2048", "DSA-2048",
+						    "P-256" };
+  static const char *methodnames[] = { "legacy", "fromdata" };
+  struct benchkeys keys;
+  struct keybuild_ctx *kb;
+  EVP_PKEY *pkey;
+  BIO *out;
+  double start, elapsed;
+  int iterations = 2000;
+  int type, method, i;
+
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+  if (argc == 2) iterations = atoi(argv[1]);
+  if (iterations <= 0) {
+    fprintf(stderr, "Iterations must be positive\n");
+    return 1;
+  }
+
+  make_benchkeys(&keys);
+  kb = keybuild_ctx_new();
+  out = BIO_new(BIO_s_mem());
+  if (kb == NULL || out == NULL) {
+    ERR_print_errors_fp(stderr);
+    return 1;
+  }
+
+  printf("%-10s %-8s %12s\n", "key", "method", "keys/s");
+  for (type = 0; type < KEYBUILD_NTYPES; type++) {
+    for (method = KEYBUILD_LEGACY; method <= KEYBUILD_FROMDATA; method++) {
+      if (!keybuild_ctx_set_method(kb, method)) {
+	printf("%-10s %-8s %12s\n", typenames[type], methodnames[method],
+	       "n/a");
+	continue;
+      }
+      start = now();
+      for (i = 0; i < iterations; i++) {
+	pkey = build(kb, &keys, type);
+	if (pkey == NULL) {
+	  fprintf(stderr, "Error building %s key\n", typenames[type]);
+	  ERR_print_errors_fp(stderr);
+	  return 1;
+	}
+	if (keybuild_write(kb, pkey, KEYBUILD_PKCS8_PEM, out) == 0) {
+	  fprintf(stderr, "Error writing %s key\n", typenames[type]);
+	  ERR_print_errors_fp(stderr);
+	  return 1;
+	}
+	EVP_PKEY_free(pkey);
+	(void)BIO_reset(out);
+      }
+      elapsed = now() - start;
+      printf("%-10s %-8s %12.0f\n", typenames[type],
+	     methodnames[method], iterations / elapsed);
+    }
+  }
+
+  BIO_free(out);
+  keybuild_ctx_free(kb);
+  return 0;
+}
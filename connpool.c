@@ -0,0 +1,285 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "connpool.h"
+
+/* One hardserver connection and the number of commands using it.
+   A connection that has failed is detached from its slot at once, but
+   only disconnected when the last command still using it returns. */
+struct connpool_conn {
+  NFastApp_Connection conn;
+  int users;
+};
+
+struct connpool_slot {
+  /* Protects everything below, and the users count of every
+     connection this slot has handed out.  Not held during a
+     transaction. */
+  pthread_mutex_t lock;
+  struct connpool_conn *cur; /* NULL while disconnected */
+  struct connpool_stats stats;
+};
+
+struct connpool {
+  NFast_AppHandle app;
+  int nslots;
+  struct connpool_slot *slots;
+};
+
+static M_Status connpool_connect(struct connpool *pool,
+				 struct connpool_conn **conn_r);
+static void connpool_disconnect(struct connpool *pool,
+				struct connpool_conn *conn);
+
+static double connpool_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+M_Status connpool_new(NFast_AppHandle app, int nconns,
+		      struct connpool **pool_r)
+{
+  struct connpool *pool;
+  M_Status status;
+  int i;
+
+  *pool_r = NULL;
+  if (nconns < 1) return Status_InvalidParameter;
+
+  pool = (struct connpool *)NFastApp_Malloc(app, sizeof(*pool), NULL, NULL);
+  if (!pool) return Status_NoHostMemory;
+  pool->app = app;
+  pool->nslots = 0;
+  pool->slots = (struct connpool_slot *)NFastApp_Malloc(app,
+							nconns *
+							sizeof(*pool->slots),
+							NULL, NULL);
+  if (!pool->slots) {
+    NFastApp_Free(app, pool, NULL, NULL);
+    return Status_NoHostMemory;
+  }
+  memset(pool->slots, 0, nconns * sizeof(*pool->slots));
+
+  for (i = 0; i < nconns; i++) {
+    pthread_mutex_init(&pool->slots[i].lock, NULL);
+    pool->nslots++;
+    status = connpool_connect(pool, &pool->slots[i].cur);
+    if (status != Status_OK) {
+      connpool_free(pool);
+      return status;
+    }
+  }
+
+  *pool_r = pool;
+  return Status_OK;
+}
+
+void connpool_free(struct connpool *pool)
+{
+  int i;
+
+  if (!pool) return;
+  for (i = 0; i < pool->nslots; i++) {
+    if (pool->slots[i].cur)
+      connpool_disconnect(pool, pool->slots[i].cur);
+    pthread_mutex_destroy(&pool->slots[i].lock);
+  }
+  NFastApp_Free(pool->app, pool->slots, NULL, NULL);
+  NFastApp_Free(pool->app, pool, NULL, NULL);
+}
+
+int connpool_size(const struct connpool *pool)
+{
+  return pool->nslots;
+}
+
+int connpool_shard(const struct connpool *pool, int worker)
+{
+  return worker % pool->nslots;
+}
+
+int connpool_retryable(M_Status status)
+{
+  /* The hardserver went away, or the socket underneath us failed. */
+  return status == Status_ServerNotRunning || status == Status_OSErrorErrno;
+}
+
+static M_Status connpool_connect(struct connpool *pool,
+				 struct connpool_conn **conn_r)
+{
+  struct connpool_conn *conn;
+  M_Status status;
+
+  conn = (struct connpool_conn *)NFastApp_Malloc(pool->app, sizeof(*conn),
+						 NULL, NULL);
+  if (!conn) return Status_NoHostMemory;
+  conn->users = 0;
+  status = NFastApp_Connect(pool->app, &conn->conn, 0, NULL);
+  if (status != Status_OK) {
+    NFastApp_Free(pool->app, conn, NULL, NULL);
+    return status;
+  }
+  *conn_r = conn;
+  return Status_OK;
+}
+
+static void connpool_disconnect(struct connpool *pool,
+				struct connpool_conn *conn)
+{
+  NFastApp_Disconnect(conn->conn, NULL);
+  NFastApp_Free(pool->app, conn, NULL, NULL);
+}
+
+/* Take a slot for one command: make sure it is connected and count
+   the command as a user of the connection.  Returns the connection to
+   use, or NULL with *status_r set if we could not (re)connect. */
+static struct connpool_conn *connpool_acquire(struct connpool *pool,
+					      struct connpool_slot *slot,
+					      M_Status *status_r)
+{
+  struct connpool_conn *conn = NULL;
+
+  pthread_mutex_lock(&slot->lock);
+  if (!slot->cur) {
+    *status_r = connpool_connect(pool, &slot->cur);
+    if (*status_r == Status_OK)
+      slot->stats.reconnects++;
+  }
+  if (slot->cur) {
+    conn = slot->cur;
+    conn->users++;
+    slot->stats.inflight++;
+    if (slot->stats.inflight > slot->stats.maxinflight)
+      slot->stats.maxinflight = slot->stats.inflight;
+  }
+  pthread_mutex_unlock(&slot->lock);
+
+  return conn;
+}
+
+/* Account for a finished command.  If it lost the connection, detach
+   that from the slot and connect afresh, so that later commands go to
+   the new one.  Other workers on the same slot may still be in
+   NFastApp_Transact() on the dead connection, so whichever command
+   finishes with it last disconnects it. */
+static void connpool_release(struct connpool *pool,
+			     struct connpool_slot *slot,
+			     struct connpool_conn *conn,
+			     M_Status status, double started)
+{
+  double latency = connpool_now() - started;
+
+  pthread_mutex_lock(&slot->lock);
+  slot->stats.inflight--;
+  slot->stats.transactions++;
+  slot->stats.totallatency += latency;
+  if (latency > slot->stats.maxlatency)
+    slot->stats.maxlatency = latency;
+  if (connpool_retryable(status)) {
+    slot->stats.failures++;
+    if (slot->cur == conn) {
+      slot->cur = NULL;
+      if (connpool_connect(pool, &slot->cur) == Status_OK)
+	slot->stats.reconnects++;
+    }
+  }
+  conn->users--;
+  if (conn->users == 0 && slot->cur != conn)
+    connpool_disconnect(pool, conn);
+  pthread_mutex_unlock(&slot->lock);
+}
+
+M_Status connpool_transact(struct connpool *pool, int shard,
+			   M_Command *cmd, M_Reply *reply)
+{
+  struct connpool_slot *slot = &pool->slots[shard];
+  struct connpool_conn *conn;
+  M_Status status = Status_OK;
+  double started;
+
+  conn = connpool_acquire(pool, slot, &status);
+  if (!conn) return status;
+  started = connpool_now();
+  status = NFastApp_Transact(conn->conn, NULL, cmd, reply, 0);
+  connpool_release(pool, slot, conn, status, started);
+
+  return status;
+}
+
+M_Status connpool_loadblob(struct connpool *pool, int shard,
+			   M_ModuleID module,
+			   const M_ByteBlock *blob,
+			   M_KeyID *keyid_r,
+			   const char *what)
+{
+  struct connpool_slot *slot = &pool->slots[shard];
+  struct connpool_conn *conn;
+  M_Status status = Status_OK;
+  double started;
+
+  conn = connpool_acquire(pool, slot, &status);
+  if (!conn) return status;
+  started = connpool_now();
+  status = NFKM_cmd_loadblob(pool->app, conn->conn, module, blob, 0,
+			     keyid_r, what, NULL);
+  connpool_release(pool, slot, conn, status, started);
+
+  return status;
+}
+
+void connpool_getstats(struct connpool *pool, int shard,
+		       struct connpool_stats *stats)
+{
+  struct connpool_slot *slot = &pool->slots[shard];
+
+  pthread_mutex_lock(&slot->lock);
+  *stats = slot->stats;
+  pthread_mutex_unlock(&slot->lock);
+}
+
+void connpool_printstats(struct connpool *pool, FILE *out)
+{
+  struct connpool_stats stats;
+  int i;
+
+  fprintf(out, "%5s %8s %6s %8s %10s %10s %6s %6s\n",
+	  "conn", "cmds", "depth", "maxdepth", "avg ms", "max ms",
+	  "fail", "recon");
+  for (i = 0; i < pool->nslots; i++) {
+    connpool_getstats(pool, i, &stats);
+    fprintf(out, "%5d %8lu %6d %8d %10.3f %10.3f %6lu %6lu\n",
+	    i, stats.transactions, stats.inflight, stats.maxinflight,
+	    stats.transactions ?
+	    1000.0 * stats.totallatency / stats.transactions : 0.0,
+	    1000.0 * stats.maxlatency,
+	    stats.failures, stats.reconnects);
+  }
+}
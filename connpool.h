@@ -0,0 +1,93 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef CONNPOOL_H
+#define CONNPOOL_H
+
+#include <nfastapp.h>
+#include <nfkm.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* A fixed set of hardserver connections ("shards").  Each worker
+   * thread is pinned to one shard with connpool_shard() and sends all
+   * its commands down that connection, so workers do not queue behind
+   * each other on a single socket.  The nCore application handle must
+   * have been initialised with thread upcalls if more than one thread
+   * uses the pool.
+   *
+   * When a command fails because the connection went away, the shard
+   * reconnects before the call returns, and the original status is
+   * passed back with connpool_retryable() returning true for it.  Key
+   * IDs obtained on the old connection are gone, so the caller has to
+   * start its command sequence over.
+   */
+  struct connpool;
+
+  struct connpool_stats {
+    unsigned long transactions; /* Commands completed, good or bad */
+    unsigned long failures;     /* Commands that lost the connection */
+    unsigned long reconnects;   /* Successful reconnections */
+    int inflight;               /* Commands currently outstanding */
+    int maxinflight;            /* High water mark of the above */
+    double totallatency;        /* Seconds, summed over transactions */
+    double maxlatency;          /* Seconds */
+  };
+
+  extern M_Status connpool_new(NFast_AppHandle app, int nconns,
+			       struct connpool **pool_r);
+  extern void connpool_free(struct connpool *pool);
+
+  extern int connpool_size(const struct connpool *pool);
+
+  /* Shard a worker is pinned to */
+  extern int connpool_shard(const struct connpool *pool, int worker);
+
+  extern M_Status connpool_transact(struct connpool *pool, int shard,
+				    M_Command *cmd, M_Reply *reply);
+
+  extern M_Status connpool_loadblob(struct connpool *pool, int shard,
+				    M_ModuleID module,
+				    const M_ByteBlock *blob,
+				    M_KeyID *keyid_r,
+				    const char *what);
+
+  /* True if status means the connection was lost (and has since been
+   * re-established), so the whole command sequence may be retried. */
+  extern int connpool_retryable(M_Status status);
+
+  extern void connpool_getstats(struct connpool *pool, int shard,
+				struct connpool_stats *stats);
+
+  /* One line per shard: depth, high water mark, latency */
+  extern void connpool_printstats(struct connpool *pool, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* CONNPOOL_H */
+#endif
@@ -0,0 +1,475 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/obj_mac.h>
+#include <openssl/rand.h>
+
+#include "hsmsim.h"
+
+/* On the wire, in host byte order since both ends are on this box */
+struct hsmsim_request {
+  uint32_t id;
+  uint32_t keytype;
+  uint32_t index;
+};
+
+struct hsmsim_header {
+  uint32_t id;
+  uint32_t keytype;
+  uint32_t bits;
+  int32_t nid;
+  unsigned char hash[20];
+  uint32_t nvals;
+  uint32_t lens[HSMSIM_MAXVALS];
+};
+
+static const struct {
+  const char *name;
+  int bits;
+  int nid;
+} hsmsim_keytypes[HSMSIM_NKEYTYPES] = {
+  { "rsa2048", 2048, NID_undef },
+  { "rsa4096", 4096, NID_undef },
+  { "rsa8192", 8192, NID_undef },
+  { "dsa2048", 2048, NID_undef },
+  { "p256", 256, NID_X9_62_prime256v1 },
+  { "p384", 384, NID_secp384r1 }
+};
+
+const char *hsmsim_keytype_name(int keytype)
+{
+  if (keytype < 0 || keytype >= HSMSIM_NKEYTYPES) return "unknown";
+  return hsmsim_keytypes[keytype].name;
+}
+
+int hsmsim_keytype_byname(const char *name)
+{
+  int i;
+
+  for (i = 0; i < HSMSIM_NKEYTYPES; i++)
+    if (strcmp(hsmsim_keytypes[i].name, name) == 0) return i;
+  return -1;
+}
+
+static int readn(int fd, void *buf, size_t len)
+{
+  unsigned char *p = (unsigned char *)buf;
+  ssize_t n;
+
+  while (len > 0) {
+    n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int writen(int fd, const void *buf, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+  ssize_t n;
+
+  while (len > 0) {
+    n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Server side ------------------------ */
+
+struct hsmsim_fixture {
+  struct hsmsim_header header; /* id filled in per reply */
+  unsigned char data[HSMSIM_MAXDATA];
+  size_t datalen;
+};
+
+struct hsmsim_conn {
+  int fd;
+  pthread_mutex_t writelock;
+  int refs;               /* Reader plus queued jobs; under queue lock */
+};
+
+struct hsmsim_job {
+  struct hsmsim_conn *conn;
+  struct hsmsim_request request;
+  struct hsmsim_job *next;
+};
+
+struct hsmsim_server {
+  struct hsmsim_config config;
+  struct hsmsim_fixture *fixtures[HSMSIM_NKEYTYPES];
+  pthread_mutex_t lock;   /* Protects the queue and connection refs */
+  pthread_cond_t cond;
+  struct hsmsim_job *head, *tail;
+};
+
+static int hsmsim_addval(struct hsmsim_fixture *f, const BIGNUM *bn, int len)
+{
+  if (len == 0) len = BN_num_bytes(bn);
+  if (f->datalen + len > sizeof(f->data)) return -1;
+  if (BN_bn2binpad(bn, f->data + f->datalen, len) < 0) return -1;
+  f->header.lens[f->header.nvals++] = len;
+  f->datalen += len;
+  return 0;
+}
+
+static int hsmsim_make_fixture(int keytype, struct hsmsim_fixture *f)
+{
+  BIGNUM *a = BN_new(), *b = BN_new(), *c = BN_new(), *d = BN_new();
+  EC_GROUP *group = NULL;
+  EC_POINT *point = NULL;
+  int bits = hsmsim_keytypes[keytype].bits;
+  int rc = -1;
+
+  memset(f, 0, sizeof(*f));
+  f->header.keytype = keytype;
+  f->header.bits = bits;
+  f->header.nid = hsmsim_keytypes[keytype].nid;
+  if (RAND_bytes(f->header.hash, sizeof(f->header.hash)) != 1) goto done;
+  if (!a || !b || !c || !d) goto done;
+
+  switch (keytype) {
+  case HSMSIM_RSA2048:
+  case HSMSIM_RSA4096:
+  case HSMSIM_RSA8192:
+    if (!BN_rand(a, bits, BN_RAND_TOP_ONE, BN_RAND_BOTTOM_ODD)
+	|| !BN_set_word(b, 65537)
+	|| hsmsim_addval(f, a, 0) || hsmsim_addval(f, b, 0))
+      goto done;
+    break;
+  case HSMSIM_DSA2048:
+    if (!BN_rand(a, bits, BN_RAND_TOP_ONE, BN_RAND_BOTTOM_ODD)
+	|| !BN_rand(b, 256, BN_RAND_TOP_ONE, BN_RAND_BOTTOM_ODD)
+	|| !BN_rand(c, bits - 1, BN_RAND_TOP_ONE, BN_RAND_BOTTOM_ANY)
+	|| !BN_rand(d, bits - 1, BN_RAND_TOP_ONE, BN_RAND_BOTTOM_ANY)
+	|| hsmsim_addval(f, a, 0) || hsmsim_addval(f, b, 0)
+	|| hsmsim_addval(f, c, 0) || hsmsim_addval(f, d, 0))
+      goto done;
+    break;
+  default:
+    /* EC public points have to be on the curve, so make a real one */
+    group = EC_GROUP_new_by_curve_name(f->header.nid);
+    point = group ? EC_POINT_new(group) : NULL;
+    if (!point
+	|| !BN_rand_range(a, EC_GROUP_get0_order(group))
+	|| !EC_POINT_mul(group, point, a, NULL, NULL, NULL)
+	|| !EC_POINT_get_affine_coordinates(group, point, b, c, NULL)
+	|| hsmsim_addval(f, b, (bits + 7) / 8)
+	|| hsmsim_addval(f, c, (bits + 7) / 8))
+      goto done;
+    break;
+  }
+  rc = 0;
+
+ done:
+  EC_POINT_free(point);
+  EC_GROUP_free(group);
+  BN_free(a);
+  BN_free(b);
+  BN_free(c);
+  BN_free(d);
+  return rc;
+}
+
+static void hsmsim_conn_put(struct hsmsim_server *server,
+			    struct hsmsim_conn *conn)
+{
+  int last;
+
+  pthread_mutex_lock(&server->lock);
+  last = --conn->refs == 0;
+  pthread_mutex_unlock(&server->lock);
+  if (last) {
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->writelock);
+    free(conn);
+  }
+}
+
+/* One simulated module core */
+static void *hsmsim_core(void *arg)
+{
+  struct hsmsim_server *server = (struct hsmsim_server *)arg;
+  struct hsmsim_job *job;
+  struct hsmsim_fixture *f;
+  struct hsmsim_header header;
+  struct timespec service;
+
+  service.tv_sec = server->config.latency_us / 1000000;
+  service.tv_nsec = (server->config.latency_us % 1000000) * 1000L;
+
+  for (;;) {
+    pthread_mutex_lock(&server->lock);
+    while (server->head == NULL)
+      pthread_cond_wait(&server->cond, &server->lock);
+    job = server->head;
+    server->head = job->next;
+    if (server->head == NULL) server->tail = NULL;
+    pthread_mutex_unlock(&server->lock);
+
+    if (service.tv_sec || service.tv_nsec)
+      nanosleep(&service, NULL);
+
+    f = &server->fixtures[job->request.keytype]
+      [job->request.index % server->config.nfixtures];
+    header = f->header;
+    header.id = job->request.id;
+    /* A client that has gone away just doesn't get its reply */
+    pthread_mutex_lock(&job->conn->writelock);
+    if (writen(job->conn->fd, &header, sizeof(header)) == 0)
+      writen(job->conn->fd, f->data, f->datalen);
+    pthread_mutex_unlock(&job->conn->writelock);
+
+    hsmsim_conn_put(server, job->conn);
+    free(job);
+  }
+  return NULL;
+}
+
+struct hsmsim_reader {
+  struct hsmsim_server *server;
+  struct hsmsim_conn *conn;
+};
+
+/* Reads the requests from one client connection */
+static void *hsmsim_reader(void *arg)
+{
+  struct hsmsim_reader *reader = (struct hsmsim_reader *)arg;
+  struct hsmsim_server *server = reader->server;
+  struct hsmsim_conn *conn = reader->conn;
+  struct hsmsim_request request;
+  struct hsmsim_job *job;
+
+  free(reader);
+  while (readn(conn->fd, &request, sizeof(request)) == 0) {
+    if (request.keytype >= HSMSIM_NKEYTYPES) break;
+    job = malloc(sizeof(*job));
+    if (job == NULL) break;
+    job->conn = conn;
+    job->request = request;
+    job->next = NULL;
+    pthread_mutex_lock(&server->lock);
+    conn->refs++;
+    if (server->tail) server->tail->next = job;
+    else server->head = job;
+    server->tail = job;
+    pthread_cond_signal(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+  }
+  shutdown(conn->fd, SHUT_RD);
+  hsmsim_conn_put(server, conn);
+  return NULL;
+}
+
+/* Runs in the child.  Writes a byte to readyfd once the fixtures
+   are built and the cores are running. */
+static void hsmsim_serve(const struct hsmsim_config *config, int listenfd,
+			 int readyfd)
+{
+  struct hsmsim_server server;
+  struct hsmsim_reader *reader;
+  struct hsmsim_conn *conn;
+  pthread_t thread;
+  pthread_attr_t attr;
+  int i, j, fd;
+
+  memset(&server, 0, sizeof(server));
+  server.config = *config;
+  pthread_mutex_init(&server.lock, NULL);
+  pthread_cond_init(&server.cond, NULL);
+
+  for (i = 0; i < HSMSIM_NKEYTYPES; i++) {
+    server.fixtures[i] = calloc(config->nfixtures, sizeof(**server.fixtures));
+    if (server.fixtures[i] == NULL) _exit(1);
+    for (j = 0; j < config->nfixtures; j++)
+      if (hsmsim_make_fixture(i, &server.fixtures[i][j])) _exit(1);
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (i = 0; i < config->cores; i++)
+    if (pthread_create(&thread, &attr, hsmsim_core, &server) != 0) _exit(1);
+  if (write(readyfd, "", 1) != 1) _exit(1);
+  close(readyfd);
+
+  for (;;) {
+    fd = accept(listenfd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      _exit(1);
+    }
+    conn = calloc(1, sizeof(*conn));
+    reader = malloc(sizeof(*reader));
+    if (conn == NULL || reader == NULL) {
+      free(conn);
+      free(reader);
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->refs = 1;
+    pthread_mutex_init(&conn->writelock, NULL);
+    reader->server = &server;
+    reader->conn = conn;
+    if (pthread_create(&thread, &attr, hsmsim_reader, reader) != 0) {
+      pthread_mutex_destroy(&conn->writelock);
+      free(conn);
+      free(reader);
+      close(fd);
+    }
+  }
+}
+
+pid_t hsmsim_spawn(const struct hsmsim_config *config)
+{
+  struct sockaddr_un addr;
+  int listenfd, ready[2];
+  pid_t pid;
+  char c;
+  ssize_t n;
+
+  if (config->cores < 1 || config->nfixtures < 1 || config->latency_us < 0)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(config->path) >= sizeof(addr.sun_path)) return -1;
+  strcpy(addr.sun_path, config->path);
+
+  listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenfd < 0) return -1;
+  unlink(config->path);
+  if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+      || listen(listenfd, 128) != 0
+      || pipe(ready) != 0) {
+    close(listenfd);
+    return -1;
+  }
+
+  pid = fork();
+  if (pid == 0) {
+    close(ready[0]);
+    hsmsim_serve(config, listenfd, ready[1]);
+    _exit(0);
+  }
+  close(listenfd);
+  close(ready[1]);
+  if (pid < 0) {
+    close(ready[0]);
+    return -1;
+  }
+
+  /* Don't return until the fixtures are built, so that making them
+     does not count towards the first requests' latency.  End of file
+     means the child died. */
+  do
+    n = read(ready[0], &c, 1);
+  while (n < 0 && errno == EINTR);
+  close(ready[0]);
+  if (n != 1) {
+    hsmsim_stop(pid);
+    return -1;
+  }
+  return pid;
+}
+
+void hsmsim_stop(pid_t pid)
+{
+  if (pid <= 0) return;
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+}
+
+/* Client side ------------------------ */
+
+int hsmsim_connect(const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int hsmsim_send(int fd, uint32_t id, uint32_t keytype, uint32_t index)
+{
+  struct hsmsim_request request;
+
+  request.id = id;
+  request.keytype = keytype;
+  request.index = index;
+  return writen(fd, &request, sizeof(request));
+}
+
+int hsmsim_recv(int fd, struct hsmsim_reply *reply)
+{
+  struct hsmsim_header header;
+  size_t total = 0;
+  uint32_t i;
+
+  if (readn(fd, &header, sizeof(header))) return -1;
+  if (header.nvals > HSMSIM_MAXVALS) return -1;
+  for (i = 0; i < header.nvals; i++) {
+    if (header.lens[i] > HSMSIM_MAXDATA - total) return -1;
+    reply->lens[i] = header.lens[i];
+    reply->vals[i] = reply->data + total;
+    total += header.lens[i];
+  }
+  if (readn(fd, reply->data, total)) return -1;
+  reply->id = header.id;
+  reply->keytype = header.keytype;
+  reply->bits = header.bits;
+  reply->nid = header.nid;
+  memcpy(reply->hash, header.hash, sizeof(reply->hash));
+  reply->nvals = header.nvals;
+  return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef HSMSIM_H
+#define HSMSIM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* A local stand-in for the hardserver, for benchmarking the export
+   * path on machines without an HSM.  It runs in its own process and
+   * listens on a Unix socket.  Clients ask for the public half of a
+   * fixture key, and each request is held for a fixed service time on
+   * one of a fixed number of simulated module cores before the reply
+   * goes back.  Replies can overtake each other, as with the real
+   * thing.  Fixture keys are synthetic: random moduli, but EC points
+   * that are on the curve.
+   */
+
+  enum hsmsim_keytype {
+    HSMSIM_RSA2048 = 0,
+    HSMSIM_RSA4096,
+    HSMSIM_RSA8192,
+    HSMSIM_DSA2048,
+    HSMSIM_P256,
+    HSMSIM_P384,
+    HSMSIM_NKEYTYPES
+  };
+
+#define HSMSIM_MAXVALS 4
+#define HSMSIM_MAXDATA 4096
+
+  struct hsmsim_config {
+    const char *path;  /* Unix socket to listen on */
+    int latency_us;    /* Service time of one request */
+    int cores;         /* Requests the module works on at once */
+    int nfixtures;     /* Distinct keys per key type */
+  };
+
+  struct hsmsim_reply {
+    uint32_t id;       /* As passed to hsmsim_send() */
+    uint32_t keytype;  /* enum hsmsim_keytype */
+    uint32_t bits;     /* Key length */
+    int32_t nid;       /* Curve, for EC keys */
+    unsigned char hash[20];
+    uint32_t nvals;
+    uint32_t lens[HSMSIM_MAXVALS];
+    /* Big-endian public values, in the order nCore exports them:
+     * RSA n, e; DSA p, q, g, y; EC x, y. */
+    const unsigned char *vals[HSMSIM_MAXVALS];
+    unsigned char data[HSMSIM_MAXDATA];
+  };
+
+  /* Start the stand-in.  Returns its process ID once its fixtures
+   * are built and it is serving requests, or -1. */
+  extern pid_t hsmsim_spawn(const struct hsmsim_config *config);
+  extern void hsmsim_stop(pid_t pid);
+
+  extern const char *hsmsim_keytype_name(int keytype);
+  /* Parse a name as returned above; -1 if unknown */
+  extern int hsmsim_keytype_byname(const char *name);
+
+  /* Client side.  hsmsim_connect() returns a socket, the others 0;
+   * all return -1 on error. */
+  extern int hsmsim_connect(const char *path);
+  extern int hsmsim_send(int fd, uint32_t id, uint32_t keytype,
+			 uint32_t index);
+  extern int hsmsim_recv(int fd, struct hsmsim_reply *reply);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* HSMSIM_H */
+#endif
@@ -23,14 +23,26 @@
  */
 
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <openssl/err.h>
 #include <openssl/evp.h>
-#include <openssl/pem.h>
+#include <openssl/obj_mac.h>
 
 #include <nfkm.h>
+#include <ncthread-upcalls.h>
+#include "connpool.h"
+#include "keybuild.h"
+#include "keyshard.h"
+#include "keytag.h"
+#include "kmindex.h"
 #include "osslbignum.h"
 
 #define BUGOUT(rc, text) if ((rc)) {		\
@@ -68,142 +80,115 @@ void ossl_print_errors(void)
   }
 }
 
-/* Make a tag of suitable length with the NFKM Hash of the key in it */
+/* Make a tag of suitable length with the NFKM Hash of the key in
+   it, in the given tag format (see keytag.h).  If the value is too
+   short for a version 1 tag, a version 2 tag is made instead. */
 BIGNUM *make_tag(struct NFast_Application *app,
 		 struct NFast_Call_Context *cctx,
 		 struct NFast_Transaction_Context *tctx,
-		 M_KeyHash *nfkmhash, int len);
-
-/* Identifier at the start of the tag.  Length should be 10. */
-#define TAG "NFKM Hash:"
+		 M_KeyHash *nfkmhash, int len,
+		 int version, int keytype);
 
 BIGNUM *make_tag(struct NFast_Application *app,
 		 struct NFast_Call_Context *cctx,
 		 struct NFast_Transaction_Context *tctx,
-		 M_KeyHash *nfkmhash, int len) {
+		 M_KeyHash *nfkmhash, int len,
+		 int version, int keytype) {
   BIGNUM *bn = NULL;
-  const unsigned char *buf;
-  unsigned char *pos;
-  int chars;
+  unsigned char *buf;
 
   /* Length must be a multiple of 4 */
   if ((len & 3) != 0) return NULL;
-  /* Leading tag is 11 bytes including trailing \0 left by sprintf.
-     NFKM Hash is 20 bytes.  Let's add a trailing \0 after the NFKM
-     hash.  This means our minimum length is 32 bytes. */
-  if (len < 32) return NULL;
+  if (version == KEYTAG_V1 && len < KEYTAG_V1_MINLEN)
+    version = KEYTAG_V2;
 
-  buf = (const unsigned char *)NFastApp_Malloc(app, len, cctx, tctx);
+  buf = (unsigned char *)NFastApp_Malloc(app, len, cctx, tctx);
   if (buf == NULL) return NULL;
-  /* Mutable copy of buf, and the pointer we will use to poke values
-     into the buffer */
-  pos = (unsigned char *)buf;
 
-  /* Whimsy: set all bytes to 42 (0x2a, which is the universal Answer to the
-     question of Life, the Universe, and Everything) so the unused
-     ones are easily distinguished. */
-  memset(pos, 42, len);
+  if (keytag_encode(buf, len, version, keytype, nfkmhash->bytes) == 0) {
+    /* Now stuff the result into a BIGNUM, which takes a copy */
+    bn = BN_bin2bn(buf, len, bn);
+  }
+  NFastApp_Free(app, (void *)buf, cctx, tctx);
 
-  chars = sprintf((char *)pos, TAG);
-  if (chars == 0) return NULL;
-  pos += chars;
-  ++pos; /* Skip the trailing \0 of the tag string. */
+  return bn;
+}
 
-  /* Hardcoding the length of the NFKM Hash construct to 20: this is
-     safe (safer than a potential buffer overrun). */
-  memcpy(pos, nfkmhash->bytes, 20);
-  pos += 20;
-  *pos = 0; /* Trailing zero after the NFKM Hash */
+/* State shared by every key exported in this run, and by all worker
+   threads. */
+struct export_env {
+  NFast_AppHandle app;
+  M_ModuleID module;
+  struct connpool *pool;
+  struct kmindex *index; /* NULL to go to NFKM_findkey every time */
+  int tagversion;
+  /* KEYBUILD_FORMAT_BITs to write, each to the output name plus the
+     format's suffix; 0 for just PKCS#8 PEM to the output name as is */
+  unsigned int formats;
+  enum keybuild_method method;
+};
 
-  /* Now stuff the result into a BIGNUM */
-  bn = BN_bin2bn(buf, len, bn);
+/* A keybuild context using the run's key construction method, or NULL
+   with the reason on the OpenSSL error stack. */
+static struct keybuild_ctx *new_keybuild(const struct export_env *env)
+{
+  struct keybuild_ctx *kb = keybuild_ctx_new();
 
-  return bn;
+  if (kb != NULL && !keybuild_ctx_set_method(kb, env->method)) {
+    keybuild_ctx_free(kb);
+    kb = NULL;
+  }
+  return kb;
 }
 
-int main(int argc, char *argv[])
+/* Write one encoded key out.  Returns 0 on success and 1 on failure,
+   having said why on stderr. */
+static int write_output(const char *name, const unsigned char *data,
+			size_t len)
 {
-  NFast_AppHandle nfapp;
-  NFastAppInitArgs nfargs;
-  NFastApp_Connection nfconn;
-  NFKM_WorldInfo *world;
-  NFKM_KeyIdent keyident;
-  NFKM_Key *keyinfo;
-  NFKM_ModuleInfo *moduleinfo;
-  M_KeyID keyid;
-  M_Command cmd;
-  M_Reply reply;
-  M_KeyType keytype;
-  M_Word keylength;
-  M_KeyHash keyhash;
-  int status;
-  EVP_PKEY *pkey;
-  RSA *rsa;
-  DSA *dsa;
-  EC_KEY *ec;
-  EC_GROUP *ecgroup;
-  int flag = 0;
-  M_ECPoint mpublic;
-  EC_POINT *ecpublic;
-  BN_CTX *bnctx;
-  BIGNUM *tag;
-  char *outname;
-  FILE *outfile = NULL;
+  FILE *outfile;
   char *errstr;
 
-  /* We need two arguments: key appname and ident. Without both we
-     cannot proceed. */
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s appname ident outfilename\n", argv[0]);
-    goto cleanup;
+  outfile = fopen(name, "w");
+  if (outfile == NULL) {
+    errstr = strerror(errno);
+    fprintf(stderr, "Error opening %s for writing: %s\n", name, errstr);
+    return 1;
   }
-  keyident.appname = argv[1];
-  keyident.ident = argv[2];
-  outname = argv[3];
-
-  /* For now, zero out the entire args structure.  We will add upcalls
-     as we find them necessary */
-  bzero(&nfargs, sizeof(nfargs));
-  nfargs.flags = NFAPP_IF_BIGNUM;
-  nfargs.bignumupcalls = &osslbn_upcalls;
-
-  status = NFastApp_InitEx(&nfapp, &nfargs, NULL);
-  BUGOUT(status, "error calling NFastApp_InitEx");
-
-  world = NULL;
-  status = NFKM_getinfo(nfapp, &world, NULL);
-  BUGOUT(status, "error calling NFKM_getinfo");
-
-  status = NFastApp_Connect(nfapp, &nfconn, 0, NULL);
-  BUGOUT(status, "error calling NFastApp_Connect");
-
-  /* Find the key in the file system and make sure it exists. */
-  status = NFKM_findkey(nfapp, keyident, &keyinfo, NULL);
-  BUGOUT(status, "error calling NFKM_findkey");
-
-  if (!keyinfo) {
-    fprintf(stderr, "Key does not exist:\napp: %s ident: %s\n",
-	    keyident.appname, keyident.ident);
-    goto cleanup;
+  if (fwrite(data, 1, len, outfile) != len) {
+    errstr = strerror(errno);
+    fprintf(stderr, "Error writing %s: %s\n", name, errstr);
+    /* Ignore int result b/c we're failing anyway. */
+    fclose(outfile);
+    return 1;
   }
-  if (!keyinfo->pubblob.len) {
-    /* Nefarious caller tried to slip us a symmetric key with no public blob */
-    fprintf(stderr, "Key does not have a public half!\n");
-    goto cleanup;
+  if (fclose(outfile) != 0) {
+    errstr = strerror(errno);
+    fprintf(stderr, "Error closing %s: %s\n", name, errstr);
+    return 1;
   }
+  return 0;
+}
 
-  /* Now find a suitable module to load the key onto.  We don't care
-     which of our modules gets to do this, as long as it's Usable */
-  status = NFKM_getusablemodule(world, 0, &moduleinfo);
-  BUGOUT(status, "error finding Usable module");
+/* Load the public blob of the key on the HSM and ask for its type,
+   length, hash and public values.  The loaded key is destroyed again
+   before returning.  On success the caller frees *exported with
+   NFastApp_Free_Reply(). */
+static M_Status fetch_public(struct export_env *env, int shard,
+			     NFKM_Key *keyinfo,
+			     M_KeyType *keytype_r, M_Word *keylength_r,
+			     M_KeyHash *keyhash_r, M_Reply *exported)
+{
+  M_KeyID keyid = 0;
+  M_Command cmd;
+  M_Reply reply;
+  M_Status status;
 
-  status = NFKM_cmd_loadblob(nfapp, nfconn,
-			     moduleinfo->module,
-			     &keyinfo->pubblob,
-			     0,
-			     &keyid,
-			     "loading public key blob",
-			     NULL);
+  bzero(exported, sizeof(*exported));
+
+  status = connpool_loadblob(env->pool, shard, env->module,
+			     &keyinfo->pubblob, &keyid,
+			     "loading public key blob");
   BUGOUT(status, "error loading public key");
 
   /* There is no NFKM function for GetKeyInfoEx, so we have to drop
@@ -212,75 +197,146 @@ int main(int argc, char *argv[])
   bzero(&reply, sizeof(reply));
   cmd.cmd = Cmd_GetKeyInfoEx;
   cmd.args.getkeyinfoex.key = keyid;
-  status = NFastApp_Transact(nfconn, NULL, &cmd, &reply, 0);
+  status = connpool_transact(env->pool, shard, &cmd, &reply);
   BUGOUT(status, "error getting key information");
-  BUGOUT(reply.status, "error in key information");
-  keytype = reply.reply.getkeyinfoex.type;
-  keylength = reply.reply.getkeyinfoex.length;
-  keyhash = reply.reply.getkeyinfoex.hash;
+  status = reply.status;
+  if (status == Status_OK) {
+    *keytype_r = reply.reply.getkeyinfoex.type;
+    *keylength_r = reply.reply.getkeyinfoex.length;
+    *keyhash_r = reply.reply.getkeyinfoex.hash;
+  }
+  /* Done with the reply whatever its status says */
+  NFastApp_Free_Reply(env->app, NULL, NULL, &reply);
+  BUGOUT(status, "error in key information");
 
   /* Now get the public key data */
   bzero(&cmd, sizeof(cmd));
-  bzero(&reply, sizeof(reply));
   cmd.cmd = Cmd_Export;
   cmd.args.export.key = keyid;
-  status = NFastApp_Transact(nfconn, NULL, &cmd, &reply, 0);
+  status = connpool_transact(env->pool, shard, &cmd, exported);
   BUGOUT(status, "error exporting public key data");
-  BUGOUT(reply.status, "error in exported public key data");
+  status = exported->status;
+  BUGOUT(status, "error in exported public key data");
 
-  /* Key data will be in reply.reply.export.data, and is wildly
-     different depending on key type.  Of course the same applies to
-     what we will need to do with the key data in OpenSSL. */
+ cleanup:
+  if (status != Status_OK)
+    NFastApp_Free_Reply(env->app, NULL, NULL, exported);
+  /* A key ID does not survive a lost connection, so there is nothing
+     to destroy in that case. */
+  if (keyid && !connpool_retryable(status)) {
+    bzero(&cmd, sizeof(cmd));
+    bzero(&reply, sizeof(reply));
+    cmd.cmd = Cmd_Destroy;
+    cmd.args.destroy.key = keyid;
+    if (connpool_transact(env->pool, shard, &cmd, &reply) == Status_OK)
+      NFastApp_Free_Reply(env->app, NULL, NULL, &reply);
+  }
 
-  pkey = EVP_PKEY_new();
-  if (pkey == NULL) {
-    ossl_print_errors();
+  return status;
+}
+
+/* Write a reference key file for one key.  If the caller has found
+   the key already it passes it in as found, otherwise NULL.  The
+   KEYBUILD_FORMAT_BITs written are stored in *written_r, which can
+   leave out formats the key type has no encoding in.  Returns 0 on
+   success and 1 on failure, having said why on stderr. */
+static int export_key(struct export_env *env, int shard,
+		      struct keybuild_ctx *kb,
+		      NFKM_KeyIdent keyident, NFKM_Key *found,
+		      const char *outname, unsigned int *written_r)
+{
+  NFKM_Key *keyinfo = found;
+  int ownkeyinfo = 0;
+  M_Reply exported;
+  int havereply = 0;
+  M_KeyType keytype;
+  M_Word keylength;
+  M_KeyHash keyhash;
+  int status;
+  EVP_PKEY *pkey = NULL;
+  int nid;
+  M_ECPoint mpublic;
+  BIGNUM *tag = NULL;
+  struct keybuild_encoded enc;
+  unsigned int formats;
+  char *name;
+  int i;
+  int rc = 1;
+
+  *written_r = 0;
+
+  /* Find the key in the file system and make sure it exists.  If the
+     key files have all been read in already, look there first; the
+     index owns what it hands out. */
+  if (!keyinfo && env->index)
+    keyinfo = kmindex_lookup(env->index, keyident);
+  if (!keyinfo) {
+    status = NFKM_findkey(env->app, keyident, &keyinfo, NULL);
+    BUGOUT(status, "error calling NFKM_findkey");
+    ownkeyinfo = 1;
+  }
+
+  if (!keyinfo) {
+    fprintf(stderr, "Key does not exist:\napp: %s ident: %s\n",
+	    keyident.appname, keyident.ident);
+    goto cleanup;
+  }
+  if (!keyinfo->pubblob.len) {
+    /* Nefarious caller tried to slip us a symmetric key with no public blob */
+    fprintf(stderr, "Key does not have a public half!\n");
     goto cleanup;
   }
 
+  /* If the hardserver connection dropped, the pool has reconnected
+     by now: have one more go from the top. */
+  status = fetch_public(env, shard, keyinfo, &keytype, &keylength,
+			&keyhash, &exported);
+  if (connpool_retryable(status))
+    status = fetch_public(env, shard, keyinfo, &keytype, &keylength,
+			  &keyhash, &exported);
+  if (status != Status_OK) goto cleanup;
+  havereply = 1;
+
+  /* Key data will be in exported.reply.export.data, and is wildly
+     different depending on key type.  Of course the same applies to
+     what we will need to do with the key data in OpenSSL. */
+
   switch (keytype) {
   case KeyType_RSAPublic:
-    rsa = RSA_new();
-    /* Assign the appropriate key values: n, e and a dummy d. */
-    rsa->n = reply.reply.export.data.data.rsapublic.n->bn;
-    rsa->e = reply.reply.export.data.data.rsapublic.e->bn;
     /* The private exponent length is half the key modulus
        size. Passing in bytes not bits. */
-    tag = make_tag(nfapp, NULL, NULL, &keyhash, keylength / (2*8));
-    rsa->d = tag;
-    /* Contrary to RSA(3) documentation, openssl rsa won't read the
-       PEM file unless p is set.  Set it to the key modulus just like
-       the embedsavefile does. */
-    rsa->p = reply.reply.export.data.data.rsapublic.n->bn;
-    /* Same for q: set to 1 just like the embedsavefile. Note this
-       utility function returns a const BIGNUM * but I don't think we
-       will attempt to change its value so discarding the constness
-       should be safe.  */
-    rsa->q = (BIGNUM *)BN_value_one();
-    rsa->dmp1 = (BIGNUM *)BN_value_one();
-    rsa->dmq1 = (BIGNUM *)BN_value_one();
-    /* Finally set the coefficient value to the tag */
-    rsa->iqmp = tag;
-    status = EVP_PKEY_assign_RSA(pkey, rsa);
-    if (status == 0) {
+    tag = make_tag(env->app, NULL, NULL, &keyhash, keylength / (2*8),
+		   env->tagversion, KEYTAG_KEY_RSA);
+    if (tag == NULL) {
+      fprintf(stderr, "Error making key tag.\n");
+      goto cleanup;
+    }
+    pkey = keybuild_rsa(kb,
+			exported.reply.export.data.data.rsapublic.n->bn,
+			exported.reply.export.data.data.rsapublic.e->bn,
+			tag);
+    if (pkey == NULL) {
       fprintf(stderr, "Error assigning RSA key.\n");
       ossl_print_errors();
       goto cleanup;
     }
     break;
   case KeyType_DSAPublic:
-    dsa = DSA_new();
-    /* This is pretty straightforward */
-    dsa->p = reply.reply.export.data.data.dsapublic.dlg.p->bn;
-    dsa->q = reply.reply.export.data.data.dsapublic.dlg.q->bn;
-    dsa->g = reply.reply.export.data.data.dsapublic.dlg.g->bn;
     /* Private key value is same lenght as the key, but of course we
        have to specify bytes not bits. */
-    tag = make_tag(nfapp, NULL, NULL, &keyhash, keylength / 8);
-    dsa->priv_key = tag;
-    dsa->pub_key = reply.reply.export.data.data.dsapublic.y->bn;
-    status = EVP_PKEY_assign_DSA(pkey, dsa);
-    if (status == 0) {
+    tag = make_tag(env->app, NULL, NULL, &keyhash, keylength / 8,
+		   env->tagversion, KEYTAG_KEY_DSA);
+    if (tag == NULL) {
+      fprintf(stderr, "Error making key tag.\n");
+      goto cleanup;
+    }
+    pkey = keybuild_dsa(kb,
+			exported.reply.export.data.data.dsapublic.dlg.p->bn,
+			exported.reply.export.data.data.dsapublic.dlg.q->bn,
+			exported.reply.export.data.data.dsapublic.dlg.g->bn,
+			exported.reply.export.data.data.dsapublic.y->bn,
+			tag);
+    if (pkey == NULL) {
       fprintf(stderr, "Error assigning DSA key.\n");
       ossl_print_errors();
       goto cleanup;
@@ -288,8 +344,7 @@ int main(int argc, char *argv[])
     break;
   case KeyType_ECPublic:
   case KeyType_ECDSAPublic:
-    ec = EC_KEY_new();
-    switch (reply.reply.export.data.data.ecpublic.curve.name) {
+    switch (exported.reply.export.data.data.ecpublic.curve.name) {
       /* It appears Red Hat strips out most Named Curves from their
        * system-provided OpenSSL.  The OpenSSL found in Fedora 18 only
        * knows the following curves:
@@ -311,84 +366,40 @@ int main(int argc, char *argv[])
 	 NISTB409, NISTB571, NISTK163, NISTK233, NISTK283, NISTK409,
 	 NISTK571, ANSIB163v1, ANSIB191v1, SECP160r1, CustomLCF.  Oh
 	 and the last one errors out... Oops generatekey. */
+    case ECName_NISTP192:
+      nid = NID_X9_62_prime192v1;
+      break;
+    case ECName_NISTP224:
+      nid = NID_secp224r1;
+      break;
     case ECName_NISTP256:
-      ecgroup = EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1);
-      if (ecgroup == NULL) {
-	fprintf(stderr, "Error obtaining EC Group\n");
-	ossl_print_errors();
-	goto cleanup;
-      }
-      flag = OPENSSL_EC_NAMED_CURVE;
+      nid = NID_X9_62_prime256v1;
       break;
     case ECName_NISTP384:
-      ecgroup = EC_GROUP_new_by_curve_name(NID_secp384r1);
-      if (ecgroup == NULL) {
-	fprintf(stderr, "Error obtaining EC Group\n");
-	ossl_print_errors();
-	goto cleanup;
-      }
-      flag = OPENSSL_EC_NAMED_CURVE;
+      nid = NID_secp384r1;
       break;
     default:
       fprintf(stderr, "Unsupported Elliptic Curve: %s\n",
-	      NF_Lookup(reply.reply.export.data.data.ecpublic.curve.name,
+	      NF_Lookup(exported.reply.export.data.data.ecpublic.curve.name,
 			NF_ECName_enumtable));
       goto cleanup;
     }
-    if(flag != 0)
-      EC_GROUP_set_asn1_flag(ecgroup, flag);
-    status = EC_KEY_set_group(ec, ecgroup);
-    if (status == 0) {
-      fprintf(stderr, "Error assigning Group to EC Key\n");
-      ossl_print_errors();
-      goto cleanup;
-    }
 
-    /* Set the private key value */
-    tag = make_tag(nfapp, NULL, NULL, &keyhash, keylength / 8);
-    status = EC_KEY_set_private_key(ec, (const BIGNUM *)tag);
-    if (status == 0) {
-      fprintf(stderr, "Error setting EC private key value\n");
-      ossl_print_errors();
+    /* Set the private key value to the tag, and the public key to the
+       exported point.  I don't know if key points are ever at
+       Infinity, but pass that on if they are. */
+    tag = make_tag(env->app, NULL, NULL, &keyhash, keylength / 8,
+		   env->tagversion, KEYTAG_KEY_EC);
+    if (tag == NULL) {
+      fprintf(stderr, "Error making key tag.\n");
       goto cleanup;
     }
-    /* Construct the public key and set it */
-    mpublic = reply.reply.export.data.data.ecpublic.Q;
-    ecpublic = EC_POINT_new((const EC_GROUP *)ecgroup);
-    if (mpublic.flags & ECPoint_flags_Infinity) {
-      /* I don't know if key points are ever at Infinity. */
-      status = EC_POINT_set_to_infinity((const EC_GROUP *)ecgroup,
-					ecpublic);
-      if (status == 0) {
-	fprintf(stderr, "Error setting Public Key point to infinity\n");
-	ossl_print_errors();
-	goto cleanup;
-      }
-    } else {
-      /* TODO once we support non-primary curves, we need to
-	 distinguish the curve type here and call the right assignment
-	 function */
-      bnctx = BN_CTX_new();
-      status = EC_POINT_set_affine_coordinates_GFp((const EC_GROUP *)ecgroup,
-						   ecpublic,
-						   mpublic.x->bn,
-						   mpublic.y->bn,
-						   bnctx);
-      if (status == 0) {
-	fprintf(stderr, "Error setting public key point coordinates\n");
-	ossl_print_errors();
-	goto cleanup;
-      }
-    }
-    status = EC_KEY_set_public_key(ec, (const EC_POINT *)ecpublic);
-    if (status == 0) {
-      fprintf(stderr, "Error setting public key\n");
-      ossl_print_errors();
-      goto cleanup;
-    }
-
-    status = EVP_PKEY_assign_EC_KEY(pkey, ec);
-    if (status == 0) {
+    mpublic = exported.reply.export.data.data.ecpublic.Q;
+    if (mpublic.flags & ECPoint_flags_Infinity)
+      pkey = keybuild_ec(kb, nid, NULL, NULL, tag);
+    else
+      pkey = keybuild_ec(kb, nid, mpublic.x->bn, mpublic.y->bn, tag);
+    if (pkey == NULL) {
       fprintf(stderr, "Error assigning EC key.\n");
       ossl_print_errors();
       goto cleanup;
@@ -400,29 +411,915 @@ int main(int argc, char *argv[])
     goto cleanup;
   }
 
-  outfile = fopen(outname, "w");
-  if (outfile == NULL) {
-    errstr = strerror(errno);
-    fprintf(stderr, "Error opening output file for writing: %s\n", errstr);
-    goto cleanup;
+  /* Encode the key once per format, all into one buffer, and only
+     then start writing files. */
+  formats = env->formats ? env->formats
+    : KEYBUILD_FORMAT_BIT(KEYBUILD_PKCS8_PEM);
+  if (keytype == KeyType_DSAPublic
+      && (formats & KEYBUILD_FORMAT_BIT(KEYBUILD_JWK))) {
+    /* There is no such thing as a DSA JWK; write the other formats */
+    formats &= ~KEYBUILD_FORMAT_BIT(KEYBUILD_JWK);
+    fprintf(stderr, "Not writing DSA key app: %s ident: %s as %s%s\n",
+	    keyident.appname, keyident.ident,
+	    keybuild_format_name(KEYBUILD_JWK),
+	    formats ? "" : ", and no other format was asked for");
+    if (!formats) goto cleanup;
   }
-  status = PEM_write_PKCS8PrivateKey(outfile, pkey, NULL, NULL, 0, NULL, NULL);
+  status = keybuild_encode(kb, pkey, formats, &enc);
   if (status == 0) {
     /* Unlike everywhere else on the system, OpenSSL uses 1 for
        success and 0 for errors. */
-    fprintf(stderr, "Error writing output file\n");
+    fprintf(stderr, "Error encoding key\n");
     ossl_print_errors();
     goto cleanup;
   }
 
-  status = fclose(outfile);
-  if (status != 0) {
-    errstr = strerror(errno);
-    fprintf(stderr, "Error closing output file: %s\n", errstr);
-    goto cleanup;
+  if (!env->formats) {
+    if (write_output(outname, enc.data[KEYBUILD_PKCS8_PEM],
+		     enc.len[KEYBUILD_PKCS8_PEM]))
+      goto cleanup;
+  } else {
+    for (i = 0; i < KEYBUILD_NFORMATS; i++) {
+      if (!enc.data[i]) continue;
+      if (asprintf(&name, "%s%s", outname, keybuild_format_suffix(i)) < 0) {
+	fprintf(stderr, "Out of memory\n");
+	goto cleanup;
+      }
+      status = write_output(name, enc.data[i], enc.len[i]);
+      free(name);
+      if (status) goto cleanup;
+    }
   }
 
+  *written_r = formats;
+  rc = 0;
+
+ cleanup:
+  EVP_PKEY_free(pkey);
+  BN_free(tag);
+  if (havereply)
+    NFastApp_Free_Reply(env->app, NULL, NULL, &exported);
+  if (keyinfo && ownkeyinfo)
+    NFKM_freekey(env->app, keyinfo, NULL);
+
+  return rc;
+}
+
+/* Batch mode ------------------------ */
+
+struct batch_job {
+  NFKM_KeyIdent keyident;
+  char *outname;
+  int skipped;  /* No reference key to be made, so not exported */
+  int failed;   /* Set by the worker that did the job */
+  unsigned int written; /* KEYBUILD_FORMAT_BITs, likewise */
+};
+
+struct batch {
+  struct export_env *env;
+  struct batch_job *jobs;
+  int njobs;
+  /* Protects the two below */
+  pthread_mutex_t lock;
+  int next;   /* Next job to hand out */
+  int failed; /* Jobs that did not produce a key file */
+};
+
+struct batch_worker {
+  struct batch *batch;
+  int workerno;
+  pthread_t thread;
+};
+
+/* Read a batch file: one "appname ident outfilename" per line.  Blank
+   lines and lines starting with # are skipped. */
+static int read_batch(const char *name, struct batch_job **jobs_r,
+		      int *njobs_r)
+{
+  FILE *f;
+  char *line = NULL;
+  size_t linesize = 0;
+  struct batch_job *jobs = NULL, *newjobs;
+  int njobs = 0, lineno = 0;
+  char *appname, *ident, *outname;
+  int rc = 1;
+
+  f = fopen(name, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Error opening batch file %s: %s\n", name,
+	    strerror(errno));
+    return 1;
+  }
+  while (getline(&line, &linesize, f) != -1) {
+    lineno++;
+    appname = ident = outname = NULL;
+    if (sscanf(line, " %ms %ms %ms", &appname, &ident, &outname) != 3) {
+      if (appname == NULL || appname[0] == '#') {
+	free(appname);
+	free(ident);
+	continue;
+      }
+      fprintf(stderr, "%s:%d: expected appname ident outfilename\n",
+	      name, lineno);
+      free(appname);
+      free(ident);
+      goto cleanup;
+    }
+    if (appname[0] == '#') {
+      free(appname);
+      free(ident);
+      free(outname);
+      continue;
+    }
+    newjobs = realloc(jobs, (njobs + 1) * sizeof(*jobs));
+    if (newjobs == NULL) {
+      fprintf(stderr, "Out of memory reading batch file\n");
+      free(appname);
+      free(ident);
+      free(outname);
+      goto cleanup;
+    }
+    jobs = newjobs;
+    memset(&jobs[njobs], 0, sizeof(*jobs));
+    jobs[njobs].keyident.appname = appname;
+    jobs[njobs].keyident.ident = ident;
+    jobs[njobs].outname = outname;
+    njobs++;
+  }
+  rc = 0;
+
+ cleanup:
+  free(line);
+  fclose(f);
+  if (rc) {
+    while (njobs-- > 0) {
+      free(jobs[njobs].keyident.appname);
+      free(jobs[njobs].keyident.ident);
+      free(jobs[njobs].outname);
+    }
+    free(jobs);
+    return rc;
+  }
+  *jobs_r = jobs;
+  *njobs_r = njobs;
   return 0;
+}
+
+static void *batch_worker_main(void *arg)
+{
+  struct batch_worker *worker = (struct batch_worker *)arg;
+  struct batch *batch = worker->batch;
+  struct keybuild_ctx *kb;
+  int shard, job, failed;
+
+  /* Each worker keeps to its own connection and its own OpenSSL
+     contexts for the whole batch. */
+  shard = connpool_shard(batch->env->pool, worker->workerno);
+  kb = new_keybuild(batch->env);
+
+  for (;;) {
+    pthread_mutex_lock(&batch->lock);
+    job = batch->next < batch->njobs ? batch->next++ : -1;
+    pthread_mutex_unlock(&batch->lock);
+    if (job < 0) break;
+    if (batch->jobs[job].skipped) continue;
+
+    if (kb == NULL) {
+      ossl_print_errors();
+      failed = 1;
+    } else {
+      failed = export_key(batch->env, shard, kb,
+			  batch->jobs[job].keyident, NULL,
+			  batch->jobs[job].outname,
+			  &batch->jobs[job].written);
+    }
+    batch->jobs[job].failed = failed;
+    if (failed) {
+      fprintf(stderr, "Failed to export app: %s ident: %s\n",
+	      batch->jobs[job].keyident.appname,
+	      batch->jobs[job].keyident.ident);
+      pthread_mutex_lock(&batch->lock);
+      batch->failed++;
+      pthread_mutex_unlock(&batch->lock);
+    }
+  }
+
+  keybuild_ctx_free(kb);
+  return NULL;
+}
+
+/* Export every job in the batch with nworkers threads.  Returns the
+   number of jobs that failed. */
+static int run_batch(struct export_env *env, struct batch_job *jobs,
+		     int njobs, int nworkers)
+{
+  struct batch batch;
+  struct batch_worker *workers;
+  int i, started;
+
+  batch.env = env;
+  batch.jobs = jobs;
+  batch.njobs = njobs;
+  batch.next = 0;
+  batch.failed = 0;
+  pthread_mutex_init(&batch.lock, NULL);
+
+  workers = calloc(nworkers, sizeof(*workers));
+  if (workers == NULL) {
+    fprintf(stderr, "Out of memory starting workers\n");
+    return njobs;
+  }
+  for (started = 0; started < nworkers; started++) {
+    workers[started].batch = &batch;
+    workers[started].workerno = started;
+    if (pthread_create(&workers[started].thread, NULL, batch_worker_main,
+		       &workers[started]) != 0) {
+      fprintf(stderr, "Error starting worker thread %d\n", started);
+      break;
+    }
+  }
+  /* If no thread could be started, do the work here instead. */
+  if (started == 0)
+    batch_worker_main(&workers[0]);
+  for (i = 0; i < started; i++)
+    pthread_join(workers[i].thread, NULL);
+
+  free(workers);
+  pthread_mutex_destroy(&batch.lock);
+  return batch.failed;
+}
+
+/* Sharded export ------------------------ */
+
+static void free_job(struct batch_job *job)
+{
+  free(job->keyident.appname);
+  free(job->keyident.ident);
+  free(job->outname);
+}
+
+/* Drop the jobs for keys that belong to other shards. */
+static void shard_jobs(const struct keyshard *shard,
+		       struct batch_job *jobs, int *njobs)
+{
+  int i, kept = 0;
+
+  for (i = 0; i < *njobs; i++) {
+    if (keyshard_owns(shard, jobs[i].keyident.appname,
+		      jobs[i].keyident.ident))
+      jobs[kept++] = jobs[i];
+    else
+      free_job(&jobs[i]);
+  }
+  *njobs = kept;
+}
+
+static int compare_jobs(const void *a, const void *b)
+{
+  const struct batch_job *x = a, *y = b;
+  int c;
+
+  c = strcmp(x->keyident.appname, y->keyident.appname);
+  return c ? c : strcmp(x->keyident.ident, y->keyident.ident);
+}
+
+/* One job for every key in the index that belongs to this shard,
+   written to outdir under the name of its key file, sorted so that
+   inventories come out the same from run to run.  Also counts and
+   digests the whole world, by name alone, for the inventory.  The
+   index only has this shard's key files parsed.  Keys without a public
+   half, such as symmetric keys, have no reference key: their jobs are
+   marked skipped.  Returns 0 on success and 1 on failure, having said
+   why on stderr. */
+static int world_jobs(const struct kmindex *index,
+		      const struct keyshard *shard, const char *outdir,
+		      struct batch_job **jobs_r, int *njobs_r,
+		      long *worldkeys_r, uint64_t *worlddigest_r)
+{
+  NFKM_KeyIdent *keys;
+  NFKM_Key *keyinfo;
+  struct batch_job *jobs;
+  uint64_t digest = 0;
+  int nkeys, njobs = 0, nskipped = 0, i;
+
+  nkeys = kmindex_keys(index, &keys);
+  if (nkeys < 0) {
+    fprintf(stderr, "Out of memory listing keys\n");
+    return 1;
+  }
+  jobs = calloc(nkeys ? nkeys : 1, sizeof(*jobs));
+  if (jobs == NULL) {
+    fprintf(stderr, "Out of memory listing keys\n");
+    free(keys);
+    return 1;
+  }
+  for (i = 0; i < nkeys; i++) {
+    digest += keyshard_hash(keys[i].appname, keys[i].ident);
+    if (!keyshard_owns(shard, keys[i].appname, keys[i].ident)) continue;
+    /* A key file that could not be parsed gets a job, and is reported
+       as failed. */
+    keyinfo = kmindex_lookup(index, keys[i]);
+    if (keyinfo && !keyinfo->pubblob.len) {
+      jobs[njobs].skipped = 1;
+      nskipped++;
+    }
+    jobs[njobs].keyident.appname = strdup(keys[i].appname);
+    jobs[njobs].keyident.ident = strdup(keys[i].ident);
+    if (jobs[njobs].keyident.appname == NULL
+	|| jobs[njobs].keyident.ident == NULL
+	|| asprintf(&jobs[njobs].outname, "%s/key_%s_%s", outdir,
+		    keys[i].appname, keys[i].ident) < 0) {
+      fprintf(stderr, "Out of memory listing keys\n");
+      jobs[njobs].outname = NULL;
+      njobs++;
+      while (njobs-- > 0)
+	free_job(&jobs[njobs]);
+      free(jobs);
+      free(keys);
+      return 1;
+    }
+    njobs++;
+  }
+  free(keys);
+  qsort(jobs, njobs, sizeof(*jobs), compare_jobs);
+  if (nskipped)
+    fprintf(stderr, "Skipping %d keys without a public half\n", nskipped);
+
+  *jobs_r = jobs;
+  *njobs_r = njobs;
+  *worldkeys_r = nkeys;
+  *worlddigest_r = digest;
+  return 0;
+}
+
+/* Count and digest the distinct keys in a batch file, which are the
+   world for a sharded batch export.  The inventory lists each key once,
+   so a key may only appear once in the batch.  Returns 0 on success
+   and 1 on failure, having said why on stderr. */
+static int batch_world(const struct batch_job *jobs, int njobs,
+		       long *worldkeys_r, uint64_t *worlddigest_r)
+{
+  struct batch_job *sorted;
+  uint64_t digest = 0;
+  int i;
+
+  sorted = malloc((njobs ? njobs : 1) * sizeof(*sorted));
+  if (sorted == NULL) {
+    fprintf(stderr, "Out of memory listing keys\n");
+    return 1;
+  }
+  memcpy(sorted, jobs, njobs * sizeof(*sorted));
+  qsort(sorted, njobs, sizeof(*sorted), compare_jobs);
+  for (i = 0; i < njobs; i++) {
+    if (i > 0 && compare_jobs(&sorted[i - 1], &sorted[i]) == 0) {
+      fprintf(stderr, "app: %s ident: %s is in the batch file more than"
+	      " once\n", sorted[i].keyident.appname, sorted[i].keyident.ident);
+      free(sorted);
+      return 1;
+    }
+    digest += keyshard_hash(sorted[i].keyident.appname,
+			    sorted[i].keyident.ident);
+  }
+  free(sorted);
+
+  *worldkeys_r = njobs;
+  *worlddigest_r = digest;
+  return 0;
+}
+
+/* Write outdir/inventory for a sharded export.  With suffixes, each
+   format's file is the job's output name plus the format's suffix;
+   without, the output name is the one file.  Returns 0 on success and
+   1 on failure, having said why on stderr. */
+static int write_inventory(const char *outdir, const struct keyshard *shard,
+			   long worldkeys, uint64_t worlddigest,
+			   const struct batch_job *jobs, int njobs,
+			   int suffixes)
+{
+  enum keyshard_status entry;
+  char *files[KEYBUILD_NFORMATS];
+  char *name;
+  const char *base;
+  FILE *out;
+  int i, f, nfiles, status = 0;
+
+  if (asprintf(&name, "%s/%s", outdir, KEYSHARD_INVENTORY) < 0) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  out = fopen(name, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Error opening %s for writing: %s\n", name,
+	    strerror(errno));
+    free(name);
+    return 1;
+  }
+
+  status = keyshard_write_header(out, shard, worldkeys, worlddigest);
+  for (i = 0; i < njobs && status == 0; i++) {
+    base = strrchr(jobs[i].outname, '/') + 1;
+    nfiles = 0;
+    if (jobs[i].skipped)
+      entry = KEYSHARD_SKIPPED;
+    else if (jobs[i].failed)
+      entry = KEYSHARD_FAILED;
+    else
+      entry = KEYSHARD_OK;
+    for (f = 0; f < KEYBUILD_NFORMATS && entry == KEYSHARD_OK; f++) {
+      if (!(jobs[i].written & KEYBUILD_FORMAT_BIT(f))) continue;
+      if (asprintf(&files[nfiles], "%s%s", base,
+		   suffixes ? keybuild_format_suffix(f) : "") < 0) {
+	status = -1;
+	break;
+      }
+      nfiles++;
+    }
+    if (status == 0)
+      status = keyshard_write_entry(out, entry,
+				    jobs[i].keyident.appname,
+				    jobs[i].keyident.ident, files, nfiles);
+    while (nfiles-- > 0)
+      free(files[nfiles]);
+  }
+
+  if (fclose(out) != 0) status = -1;
+  if (status != 0)
+    fprintf(stderr, "Error writing %s: %s\n", name, strerror(errno));
+  free(name);
+  return status ? 1 : 0;
+}
+
+/* Startup ------------------------ */
+
+/* Once nCore is initialised, reading the world info, connecting to
+   the hardserver and reading key files don't depend on each other, so
+   they run side by side.  Each is timed for --startup-profile. */
+
+enum startup_phase_id {
+  PHASE_INIT = 0,
+  PHASE_WORLD,
+  PHASE_MODULE,
+  PHASE_CONNECT,
+  PHASE_KEYS,
+  PHASE_EXPORT,
+  STARTUP_NPHASES
+};
+
+struct startup_phase {
+  const char *name;
+  double start, end; /* Seconds since startup_begin(); end 0 if not run */
+};
+
+struct startup {
+  double t0;
+  struct startup_phase phases[STARTUP_NPHASES];
+
+  /* What to do */
+  NFast_AppHandle app;
+  int nconns;
+  int nthreads;            /* For reading key files */
+  M_ModuleID usemodule;    /* 0 for the first Usable one */
+  int buildindex;          /* Read every key file into an index */
+  const struct keyshard *shard; /* Only parsing this shard's files */
+  NFKM_KeyIdent *findkey;  /* Otherwise find this key, if not NULL */
+
+  /* What came of it */
+  M_Status worldstatus, connstatus, keystatus;
+  NFKM_WorldInfo *world;
+  M_ModuleID module;
+  struct connpool *pool;
+  struct kmindex *index;
+  NFKM_Key *keyinfo;
+};
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void startup_begin(struct startup *st)
+{
+  static const char *names[STARTUP_NPHASES] = {
+    "NFastApp_InitEx",
+    "NFKM_getinfo",
+    "NFKM_getusablemodule",
+    "NFastApp_Connect",
+    "key files",
+    "export"
+  };
+  int i;
+
+  bzero(st, sizeof(*st));
+  st->t0 = now();
+  for (i = 0; i < STARTUP_NPHASES; i++)
+    st->phases[i].name = names[i];
+}
+
+static void phase_start(struct startup *st, enum startup_phase_id id)
+{
+  st->phases[id].start = now() - st->t0;
+}
+
+static void phase_end(struct startup *st, enum startup_phase_id id)
+{
+  st->phases[id].end = now() - st->t0;
+}
+
+static void *startup_world(void *arg)
+{
+  struct startup *st = (struct startup *)arg;
+  NFKM_ModuleInfo *moduleinfo;
+
+  /* If we were told which module to use, the world info isn't needed
+     at all. */
+  if (st->usemodule) {
+    st->module = st->usemodule;
+    return NULL;
+  }
+
+  /* All we want is the first Usable module, but NFKM has no narrower
+     query than the full world info.  This runs alongside the other
+     steps, so its cost is hidden rather than reduced. */
+  phase_start(st, PHASE_WORLD);
+  st->worldstatus = NFKM_getinfo(st->app, &st->world, NULL);
+  phase_end(st, PHASE_WORLD);
+  if (st->worldstatus != Status_OK) return NULL;
+
+  /* Now find a suitable module to load the keys onto.  We don't care
+     which of our modules gets to do this, as long as it's Usable */
+  phase_start(st, PHASE_MODULE);
+  st->worldstatus = NFKM_getusablemodule(st->world, 0, &moduleinfo);
+  phase_end(st, PHASE_MODULE);
+  if (st->worldstatus == Status_OK)
+    st->module = moduleinfo->module;
+  return NULL;
+}
+
+static void *startup_connect(void *arg)
+{
+  struct startup *st = (struct startup *)arg;
+
+  phase_start(st, PHASE_CONNECT);
+  st->connstatus = connpool_new(st->app, st->nconns, &st->pool);
+  phase_end(st, PHASE_CONNECT);
+  return NULL;
+}
+
+static void *startup_keys(void *arg)
+{
+  struct startup *st = (struct startup *)arg;
+
+  phase_start(st, PHASE_KEYS);
+  if (st->buildindex)
+    st->keystatus = kmindex_build(st->app, NULL, st->nthreads, st->shard,
+				  &st->index);
+  else if (st->findkey)
+    st->keystatus = NFKM_findkey(st->app, *st->findkey, &st->keyinfo, NULL);
+  phase_end(st, PHASE_KEYS);
+  return NULL;
+}
+
+/* Run the startup steps that follow NFastApp_InitEx concurrently.
+   Returns the first error, having reported it. */
+static M_Status startup_run(struct startup *st)
+{
+  static void *(*const steps[])(void *) = {
+    startup_world, startup_connect, startup_keys
+  };
+  pthread_t threads[sizeof(steps) / sizeof(steps[0])];
+  int started[sizeof(steps) / sizeof(steps[0])];
+  M_Status status;
+  int i;
+
+  /* The last step runs on this thread, the others on their own; any
+     that can't get a thread run here too. */
+  for (i = 0; i < (int)(sizeof(steps) / sizeof(steps[0])) - 1; i++)
+    started[i] = pthread_create(&threads[i], NULL, steps[i], st) == 0;
+  for (i = 0; i < (int)(sizeof(steps) / sizeof(steps[0])) - 1; i++)
+    if (!started[i]) steps[i](st);
+  steps[i](st);
+  for (i = 0; i < (int)(sizeof(steps) / sizeof(steps[0])) - 1; i++)
+    if (started[i]) pthread_join(threads[i], NULL);
+
+  status = st->worldstatus;
+  BUGOUT(status, "error finding Usable module");
+  status = st->connstatus;
+  BUGOUT(status, "error calling NFastApp_Connect");
+  status = st->keystatus;
+  BUGOUT(status, st->buildindex ? "error reading key files"
+	 : "error calling NFKM_findkey");
+
+ cleanup:
+  return status;
+}
+
+static void startup_print(const struct startup *st, FILE *out)
+{
+  int i;
+
+  fprintf(out, "%-22s %10s %10s %10s\n", "phase (ms)", "start", "end",
+	  "elapsed");
+  for (i = 0; i < STARTUP_NPHASES; i++) {
+    if (st->phases[i].end == 0) {
+      fprintf(out, "%-22s %10s\n", st->phases[i].name, "skipped");
+      continue;
+    }
+    fprintf(out, "%-22s %10.3f %10.3f %10.3f\n", st->phases[i].name,
+	    1000.0 * st->phases[i].start, 1000.0 * st->phases[i].end,
+	    1000.0 * (st->phases[i].end - st->phases[i].start));
+  }
+  fprintf(out, "%-22s %10s %10.3f\n", "total", "",
+	  1000.0 * (now() - st->t0));
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+	  "Usage: %s [-t 1|2] [-f format,...] [-B builder] [-m module] [-P]"
+	  " appname ident outfilename\n"
+	  "       %s [-t 1|2] [-f format,...] [-B builder] [-m module] [-P]"
+	  " [-j workers]\n"
+	  "          [-c connections] [-S] [-s i/N]"
+	  " -b batchfile [-o outdir] | -a outdir\n"
+	  "Formats: pkcs8 pem der spki jwk\n"
+	  "Builders: legacy (default), fromdata (OpenSSL 3 only)\n",
+	  prog, prog);
+}
+
+static const struct option long_options[] = {
+  { "batch", required_argument, NULL, 'b' },
+  { "workers", required_argument, NULL, 'j' },
+  { "connections", required_argument, NULL, 'c' },
+  { "conn-stats", no_argument, NULL, 'S' },
+  { "tag-format", required_argument, NULL, 't' },
+  { "formats", required_argument, NULL, 'f' },
+  { "builder", required_argument, NULL, 'B' },
+  { "module", required_argument, NULL, 'm' },
+  { "startup-profile", no_argument, NULL, 'P' },
+  { "shard", required_argument, NULL, 's' },
+  { "all", required_argument, NULL, 'a' },
+  { "outdir", required_argument, NULL, 'o' },
+  { NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+  NFastAppInitArgs nfargs;
+  NFKM_KeyIdent keyident;
+  struct startup st;
+  struct export_env env;
+  struct keybuild_ctx *kb;
+  struct batch_job *jobs = NULL;
+  int njobs = 0;
+  const char *batchname = NULL, *alldir = NULL, *outdir = NULL;
+  char *outname;
+  struct keyshard shard = { 0, 1 };
+  long worldkeys = 0;
+  uint64_t worlddigest = 0;
+  int nworkers = 0, nconns = 0, connstats = 0, profile = 0;
+  int tagversion = KEYTAG_V1;
+  unsigned int formats = 0, written;
+  int method = KEYBUILD_LEGACY;
+  char *format, *save;
+  M_ModuleID usemodule = 0;
+  int opt, status, failed, f, i;
+
+  startup_begin(&st);
+
+  while ((opt = getopt_long(argc, argv, "b:j:c:St:f:B:m:Ps:a:o:", long_options,
+			    NULL)) != -1) {
+    switch (opt) {
+    case 'b':
+      batchname = optarg;
+      break;
+    case 'j':
+      nworkers = atoi(optarg);
+      if (nworkers < 1) {
+	fprintf(stderr, "Number of workers must be positive\n");
+	return 1;
+      }
+      break;
+    case 'c':
+      nconns = atoi(optarg);
+      if (nconns < 1) {
+	fprintf(stderr, "Number of connections must be positive\n");
+	return 1;
+      }
+      break;
+    case 'S':
+      connstats = 1;
+      break;
+    case 't':
+      tagversion = atoi(optarg);
+      if (tagversion != KEYTAG_V1 && tagversion != KEYTAG_V2) {
+	fprintf(stderr, "Tag format must be 1 or 2\n");
+	return 1;
+      }
+      break;
+    case 'f':
+      for (format = strtok_r(optarg, ",", &save); format;
+	   format = strtok_r(NULL, ",", &save)) {
+	f = keybuild_format_byname(format);
+	if (f < 0) {
+	  fprintf(stderr, "Unknown output format: %s\n", format);
+	  usage(argv[0]);
+	  return 1;
+	}
+	formats |= KEYBUILD_FORMAT_BIT(f);
+      }
+      break;
+    case 'B':
+      method = keybuild_method_byname(optarg);
+      if (method < 0) {
+	fprintf(stderr, "Unknown or unsupported builder: %s\n", optarg);
+	usage(argv[0]);
+	return 1;
+      }
+      break;
+    case 'm':
+      if (atoi(optarg) < 1) {
+	fprintf(stderr, "Module number must be positive\n");
+	return 1;
+      }
+      usemodule = atoi(optarg);
+      break;
+    case 'P':
+      profile = 1;
+      break;
+    case 's':
+      if (keyshard_parse(optarg, &shard) != 0) {
+	fprintf(stderr, "Shard must be i/N with 0 <= i < N\n");
+	return 1;
+      }
+      break;
+    case 'a':
+      alldir = optarg;
+      break;
+    case 'o':
+      outdir = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if ((batchname && alldir) || (outdir && !batchname)) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (shard.count > 1 && !batchname && !alldir) {
+    fprintf(stderr, "--shard needs a batch file or --all\n");
+    return 1;
+  }
+  if (shard.count > 1 && batchname && !outdir) {
+    fprintf(stderr, "--shard with a batch file needs --outdir, so that"
+	    " krmerge can check the slices\n");
+    return 1;
+  }
+
+  if (alldir) {
+    if (optind != argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    if (mkdir(alldir, 0777) != 0 && errno != EEXIST) {
+      fprintf(stderr, "Error creating %s: %s\n", alldir, strerror(errno));
+      return 1;
+    }
+    /* Every file gets a suffix, so that the inventory can list them */
+    if (formats == 0) formats = KEYBUILD_FORMAT_BIT(KEYBUILD_PKCS8_PEM);
+    /* The jobs come from the index, once it has been built */
+    if (nworkers == 0) nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1) nworkers = 1;
+    if (nconns == 0 || nconns > nworkers) nconns = nworkers;
+  } else if (batchname) {
+    if (optind != argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    if (read_batch(batchname, &jobs, &njobs)) return 1;
+    if (outdir) {
+      /* The batch file is the world, and its output names go in
+	 outdir, where the inventory can list them. */
+      if (batch_world(jobs, njobs, &worldkeys, &worlddigest)) return 1;
+      for (i = 0; i < njobs; i++) {
+	if (strchr(jobs[i].outname, '/')) {
+	  fprintf(stderr, "Output name %s is not a plain file name, as"
+		  " --outdir needs\n", jobs[i].outname);
+	  return 1;
+	}
+	if (asprintf(&outname, "%s/%s", outdir, jobs[i].outname) < 0) {
+	  fprintf(stderr, "Out of memory\n");
+	  return 1;
+	}
+	free(jobs[i].outname);
+	jobs[i].outname = outname;
+      }
+      if (mkdir(outdir, 0777) != 0 && errno != EEXIST) {
+	fprintf(stderr, "Error creating %s: %s\n", outdir, strerror(errno));
+	return 1;
+      }
+    }
+    /* Every host reads the same batch file and keeps its own slice */
+    shard_jobs(&shard, jobs, &njobs);
+    if (outdir)
+      qsort(jobs, njobs, sizeof(*jobs), compare_jobs);
+    /* By default use every core, with a connection per worker so no
+       two workers share a socket. */
+    if (nworkers == 0) nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1) nworkers = 1;
+    if (nworkers > njobs && njobs > 0) nworkers = njobs;
+    if (nconns == 0 || nconns > nworkers) nconns = nworkers;
+  } else {
+    /* We need three arguments: key appname, ident and output file
+       name. Without all of them we cannot proceed. */
+    if (argc - optind != 3) {
+      usage(argv[0]);
+      return 1;
+    }
+    keyident.appname = argv[optind];
+    keyident.ident = argv[optind + 1];
+    nworkers = nconns = 1;
+  }
+
+  /* Zero out the entire args structure and add the upcalls we need:
+     OpenSSL BIGNUMs, and threads for startup and the batch workers. */
+  bzero(&nfargs, sizeof(nfargs));
+  nfargs.flags = NFAPP_IF_BIGNUM | NFAPP_IF_NEWTHREAD;
+  nfargs.bignumupcalls = &osslbn_upcalls;
+  nfargs.newthreadupcalls = &thread_upcalls_posix;
+
+  phase_start(&st, PHASE_INIT);
+  status = NFastApp_InitEx(&st.app, &nfargs, NULL);
+  phase_end(&st, PHASE_INIT);
+  BUGOUT(status, "error calling NFastApp_InitEx");
+
+  /* For a batch or the whole world, read every key file up front
+     rather than one at a time as the workers get to them.  For a
+     single key, just find that one. */
+  st.nconns = nconns;
+  st.nthreads = nworkers;
+  st.usemodule = usemodule;
+  st.shard = &shard;
+  st.buildindex = batchname != NULL || alldir != NULL;
+  st.findkey = st.buildindex ? NULL : &keyident;
+  status = startup_run(&st);
+  if (status != Status_OK) goto cleanup;
+
+  bzero(&env, sizeof(env));
+  env.app = st.app;
+  env.module = st.module;
+  env.pool = st.pool;
+  env.index = st.index;
+  env.tagversion = tagversion;
+  env.formats = formats;
+  env.method = method;
+
+  if (alldir
+      && world_jobs(st.index, &shard, alldir, &jobs, &njobs,
+		    &worldkeys, &worlddigest))
+    goto cleanup;
+
+  phase_start(&st, PHASE_EXPORT);
+  if (batchname || alldir) {
+    failed = run_batch(&env, jobs, njobs, nworkers);
+    if (failed)
+      fprintf(stderr, "%d of %d keys failed to export\n", failed, njobs);
+    if (alldir
+	&& write_inventory(alldir, &shard, worldkeys, worlddigest,
+			   jobs, njobs, 1))
+      failed++;
+    if (outdir
+	&& write_inventory(outdir, &shard, worldkeys, worlddigest,
+			   jobs, njobs, formats != 0))
+      failed++;
+  } else {
+    if (!st.keyinfo) {
+      fprintf(stderr, "Key does not exist:\napp: %s ident: %s\n",
+	      keyident.appname, keyident.ident);
+      goto cleanup;
+    }
+    kb = new_keybuild(&env);
+    if (kb == NULL) {
+      ossl_print_errors();
+      goto cleanup;
+    }
+    failed = export_key(&env, 0, kb, keyident, st.keyinfo,
+			argv[optind + 2], &written);
+    keybuild_ctx_free(kb);
+  }
+  phase_end(&st, PHASE_EXPORT);
+
+  if (connstats)
+    connpool_printstats(env.pool, stderr);
+  if (profile)
+    startup_print(&st, stderr);
+
+  return failed ? 1 : 0;
 
  cleanup:
   /* We got here because something errored out.  Do any cleanup
@@ -430,10 +1327,7 @@ int main(int argc, char *argv[])
      the bottom of the main() function, we don't need to clean up
      anything.  If this code is pasted into some other context, we
      will. */
-  if (outfile) {
-    /* Ignore int result b/c we're done. */
-    fclose(outfile);
-  }
-
+  if (profile)
+    startup_print(&st, stderr);
   return 1;
 }
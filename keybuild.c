@@ -0,0 +1,751 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* The legacy code path uses the low level RSA, DSA and EC_KEY
+   interfaces, which OpenSSL 3 deprecates but still provides. */
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <string.h>
+
+#include <openssl/dsa.h>
+#include <openssl/ec.h>
+#include <openssl/err.h>
+#include <openssl/obj_mac.h>
+#include <openssl/objects.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include "keybuild.h"
+
+#ifdef KEYBUILD_OSSL3
+#include <openssl/core_names.h>
+#include <openssl/encoder.h>
+#include <openssl/param_build.h>
+#endif
+
+/* Curves we can build a key for.  fieldbytes is the size of one
+   coordinate of an uncompressed point; jwkname is the curve's name in
+   a JWK "crv" member.  The JOSE registry only has P-256 and up; the
+   smaller two follow the same naming. */
+static const struct {
+  int nid;
+  const char *name;
+  int fieldbytes;
+  const char *jwkname;
+} keybuild_curves[] = {
+  { NID_X9_62_prime192v1, "prime192v1", 24, "P-192" },
+  { NID_secp224r1, "secp224r1", 28, "P-224" },
+  { NID_X9_62_prime256v1, "prime256v1", 32, "P-256" },
+  { NID_secp384r1, "secp384r1", 48, "P-384" },
+  { NID_undef, NULL, 0, NULL }
+};
+
+/* Names and file suffixes, indexed by enum keybuild_format. */
+static const struct {
+  const char *name;
+  const char *suffix;
+} keybuild_formatnames[KEYBUILD_NFORMATS] = {
+  { "pkcs8", ".pem" },
+  { "pem", ".trad.pem" },
+  { "der", ".der" },
+  { "spki", ".pub.pem" },
+  { "jwk", ".jwk" }
+};
+
+#ifdef KEYBUILD_OSSL3
+
+/* Key type names as known to the OpenSSL 3 key management, indexed
+   by enum keybuild_type. */
+static const char *keybuild_typenames[KEYBUILD_NTYPES] = {
+  "RSA",
+  "DSA",
+  "EC"
+};
+
+/* Encoder parameters for each enum keybuild_format.  There is no
+   encoder for JWK: keybuild_write_jwk() does that one by hand. */
+static const struct {
+  const char *output_type;
+  const char *output_structure;
+  int selection;
+} keybuild_formats[KEYBUILD_NFORMATS] = {
+  { "PEM", "PrivateKeyInfo", EVP_PKEY_KEYPAIR },
+  { "PEM", "type-specific", EVP_PKEY_KEYPAIR },
+  { "DER", "PrivateKeyInfo", EVP_PKEY_KEYPAIR },
+  { "PEM", "SubjectPublicKeyInfo", EVP_PKEY_PUBLIC_KEY },
+  { NULL, NULL, 0 }
+};
+
+struct keybuild_ctx {
+  enum keybuild_method method;
+  /* Lazily created, one per key type, ready for EVP_PKEY_fromdata() */
+  EVP_PKEY_CTX *fromdata[KEYBUILD_NTYPES];
+  /* Lazily created, reset for every key by keybuild_encode() */
+  BIO *mem;
+};
+
+#else
+
+struct keybuild_ctx {
+  enum keybuild_method method;
+  BIO *mem;
+};
+
+#endif
+
+static int keybuild_write_jwk(EVP_PKEY *pkey, BIO *out, int fromdata);
+
+struct keybuild_ctx *keybuild_ctx_new(void)
+{
+  struct keybuild_ctx *kb;
+
+  /* Not OPENSSL_zalloc(), which only appeared in 1.1 */
+  kb = OPENSSL_malloc(sizeof(*kb));
+  if (kb == NULL) return NULL;
+  memset(kb, 0, sizeof(*kb));
+  kb->method = KEYBUILD_LEGACY;
+  return kb;
+}
+
+int keybuild_ctx_set_method(struct keybuild_ctx *kb,
+			    enum keybuild_method method)
+{
+  switch (method) {
+  case KEYBUILD_LEGACY:
+    break;
+  case KEYBUILD_FROMDATA:
+#ifdef KEYBUILD_OSSL3
+    break;
+#else
+    return 0;
+#endif
+  default:
+    return 0;
+  }
+  kb->method = method;
+  return 1;
+}
+
+int keybuild_method_byname(const char *name)
+{
+  if (strcmp(name, "legacy") == 0) return KEYBUILD_LEGACY;
+#ifdef KEYBUILD_OSSL3
+  if (strcmp(name, "fromdata") == 0) return KEYBUILD_FROMDATA;
+#endif
+  return -1;
+}
+
+void keybuild_ctx_free(struct keybuild_ctx *kb)
+{
+#ifdef KEYBUILD_OSSL3
+  int i;
+#endif
+
+  if (!kb) return;
+#ifdef KEYBUILD_OSSL3
+  for (i = 0; i < KEYBUILD_NTYPES; i++)
+    EVP_PKEY_CTX_free(kb->fromdata[i]);
+#endif
+  BIO_free(kb->mem);
+  OPENSSL_free(kb);
+}
+
+const char *keybuild_format_name(enum keybuild_format format)
+{
+  if (format < 0 || format >= KEYBUILD_NFORMATS) return NULL;
+  return keybuild_formatnames[format].name;
+}
+
+const char *keybuild_format_suffix(enum keybuild_format format)
+{
+  if (format < 0 || format >= KEYBUILD_NFORMATS) return NULL;
+  return keybuild_formatnames[format].suffix;
+}
+
+int keybuild_format_byname(const char *name)
+{
+  int i;
+
+  for (i = 0; i < KEYBUILD_NFORMATS; i++)
+    if (strcmp(keybuild_formatnames[i].name, name) == 0) return i;
+  return -1;
+}
+
+#ifdef KEYBUILD_OSSL3
+
+static EVP_PKEY *keybuild_fromdata(struct keybuild_ctx *kb,
+				   enum keybuild_type type,
+				   OSSL_PARAM_BLD *bld)
+{
+  EVP_PKEY *pkey = NULL;
+  OSSL_PARAM *params;
+
+  if (kb->fromdata[type] == NULL) {
+    kb->fromdata[type] = EVP_PKEY_CTX_new_from_name(NULL,
+						    keybuild_typenames[type],
+						    NULL);
+    if (kb->fromdata[type] == NULL) return NULL;
+    if (EVP_PKEY_fromdata_init(kb->fromdata[type]) <= 0) {
+      EVP_PKEY_CTX_free(kb->fromdata[type]);
+      kb->fromdata[type] = NULL;
+      return NULL;
+    }
+  }
+
+  /* The builder only holds references to the BIGNUMs: this is where
+     their contents get serialised, once, into the parameter block
+     that the key management imports from. */
+  params = OSSL_PARAM_BLD_to_param(bld);
+  if (params == NULL) return NULL;
+  if (EVP_PKEY_fromdata(kb->fromdata[type], &pkey, EVP_PKEY_KEYPAIR,
+			params) <= 0)
+    pkey = NULL;
+  OSSL_PARAM_free(params);
+
+  return pkey;
+}
+
+static EVP_PKEY *keybuild_rsa_fromdata(struct keybuild_ctx *kb,
+				      const BIGNUM *n, const BIGNUM *e,
+				      const BIGNUM *tag)
+{
+  OSSL_PARAM_BLD *bld;
+  EVP_PKEY *pkey = NULL;
+
+  bld = OSSL_PARAM_BLD_new();
+  if (bld == NULL) return NULL;
+  /* Same layout as the legacy path: the tag stands in for d and the
+     coefficient, p is set to the modulus and the rest to one. */
+  if (OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_N, n)
+      && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_E, e)
+      && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_D, tag)
+      && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_FACTOR1, n)
+      && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_FACTOR2,
+				BN_value_one())
+      && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_EXPONENT1,
+				BN_value_one())
+      && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_EXPONENT2,
+				BN_value_one())
+      && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_COEFFICIENT1, tag))
+    pkey = keybuild_fromdata(kb, KEYBUILD_RSA, bld);
+  OSSL_PARAM_BLD_free(bld);
+
+  return pkey;
+}
+
+#endif
+
+EVP_PKEY *keybuild_rsa(struct keybuild_ctx *kb,
+		       const BIGNUM *n, const BIGNUM *e,
+		       const BIGNUM *tag)
+{
+#ifdef KEYBUILD_OSSL3
+  if (kb->method == KEYBUILD_FROMDATA)
+    return keybuild_rsa_fromdata(kb, n, e, tag);
+#endif
+  return keybuild_rsa_legacy(n, e, tag);
+}
+
+#ifdef KEYBUILD_OSSL3
+
+static EVP_PKEY *keybuild_dsa_fromdata(struct keybuild_ctx *kb,
+				      const BIGNUM *p, const BIGNUM *q,
+				      const BIGNUM *g, const BIGNUM *y,
+				      const BIGNUM *tag)
+{
+  OSSL_PARAM_BLD *bld;
+  EVP_PKEY *pkey = NULL;
+
+  bld = OSSL_PARAM_BLD_new();
+  if (bld == NULL) return NULL;
+  if (OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_FFC_P, p)
+      && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_FFC_Q, q)
+      && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_FFC_G, g)
+      && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_PUB_KEY, y)
+      && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_PRIV_KEY, tag))
+    pkey = keybuild_fromdata(kb, KEYBUILD_DSA, bld);
+  OSSL_PARAM_BLD_free(bld);
+
+  return pkey;
+}
+
+#endif
+
+EVP_PKEY *keybuild_dsa(struct keybuild_ctx *kb,
+		       const BIGNUM *p, const BIGNUM *q,
+		       const BIGNUM *g, const BIGNUM *y,
+		       const BIGNUM *tag)
+{
+#ifdef KEYBUILD_OSSL3
+  if (kb->method == KEYBUILD_FROMDATA)
+    return keybuild_dsa_fromdata(kb, p, q, g, y, tag);
+#endif
+  return keybuild_dsa_legacy(p, q, g, y, tag);
+}
+
+#ifdef KEYBUILD_OSSL3
+
+static EVP_PKEY *keybuild_ec_fromdata(struct keybuild_ctx *kb, int nid,
+				      const BIGNUM *x, const BIGNUM *y,
+				      const BIGNUM *tag)
+{
+  OSSL_PARAM_BLD *bld;
+  EVP_PKEY *pkey = NULL;
+  /* Uncompressed point: 0x04, then x and y each padded to the field
+     size.  Big enough for the largest curve in the table. */
+  unsigned char point[1 + 2*66];
+  size_t pointlen;
+  int i;
+
+  for (i = 0; keybuild_curves[i].nid != NID_undef; i++)
+    if (keybuild_curves[i].nid == nid) break;
+  if (keybuild_curves[i].nid == NID_undef) {
+    ERR_raise(ERR_LIB_EC, EC_R_UNKNOWN_GROUP);
+    return NULL;
+  }
+
+  if (x == NULL || y == NULL) {
+    /* The point at infinity encodes as a single zero byte */
+    point[0] = 0;
+    pointlen = 1;
+  } else {
+    point[0] = POINT_CONVERSION_UNCOMPRESSED;
+    if (BN_bn2binpad(x, point + 1, keybuild_curves[i].fieldbytes) < 0
+	|| BN_bn2binpad(y, point + 1 + keybuild_curves[i].fieldbytes,
+			keybuild_curves[i].fieldbytes) < 0)
+      return NULL;
+    pointlen = 1 + 2*keybuild_curves[i].fieldbytes;
+  }
+
+  bld = OSSL_PARAM_BLD_new();
+  if (bld == NULL) return NULL;
+  if (OSSL_PARAM_BLD_push_utf8_string(bld, OSSL_PKEY_PARAM_GROUP_NAME,
+				      keybuild_curves[i].name, 0)
+      && OSSL_PARAM_BLD_push_octet_string(bld, OSSL_PKEY_PARAM_PUB_KEY,
+					  point, pointlen)
+      && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_PRIV_KEY, tag))
+    pkey = keybuild_fromdata(kb, KEYBUILD_EC, bld);
+  OSSL_PARAM_BLD_free(bld);
+
+  return pkey;
+}
+
+#endif
+
+EVP_PKEY *keybuild_ec(struct keybuild_ctx *kb, int nid,
+		      const BIGNUM *x, const BIGNUM *y,
+		      const BIGNUM *tag)
+{
+#ifdef KEYBUILD_OSSL3
+  if (kb->method == KEYBUILD_FROMDATA)
+    return keybuild_ec_fromdata(kb, nid, x, y, tag);
+#endif
+  return keybuild_ec_legacy(nid, x, y, tag);
+}
+
+int keybuild_write(struct keybuild_ctx *kb, EVP_PKEY *pkey,
+		   enum keybuild_format format, BIO *out)
+{
+#ifdef KEYBUILD_OSSL3
+  OSSL_ENCODER_CTX *ectx;
+  int status;
+
+  if (kb->method != KEYBUILD_FROMDATA)
+    return keybuild_write_legacy(pkey, format, out);
+  if (format < 0 || format >= KEYBUILD_NFORMATS) return 0;
+  if (format == KEYBUILD_JWK) return keybuild_write_jwk(pkey, out, 1);
+  /* An encoder context is bound to the key it was created for, so
+     there is nothing to carry over from one key to the next. */
+  ectx = OSSL_ENCODER_CTX_new_for_pkey(pkey,
+				       keybuild_formats[format].selection,
+				       keybuild_formats[format].output_type,
+				       keybuild_formats[format].output_structure,
+				       NULL);
+  if (ectx == NULL) return 0;
+  if (OSSL_ENCODER_CTX_get_num_encoders(ectx) == 0) {
+    OSSL_ENCODER_CTX_free(ectx);
+    return 0;
+  }
+  status = OSSL_ENCODER_to_bio(ectx, out);
+  OSSL_ENCODER_CTX_free(ectx);
+
+  return status;
+#else
+  return keybuild_write_legacy(pkey, format, out);
+#endif
+}
+
+int keybuild_encode(struct keybuild_ctx *kb, EVP_PKEY *pkey,
+		    unsigned int formats, struct keybuild_encoded *enc)
+{
+  size_t start[KEYBUILD_NFORMATS];
+  char *data;
+  int i;
+
+  memset(enc, 0, sizeof(*enc));
+  if (kb->mem == NULL) {
+    kb->mem = BIO_new(BIO_s_mem());
+    if (kb->mem == NULL) return 0;
+  }
+  /* Resetting a memory BIO empties it but keeps its allocation, so
+     after the first few keys the buffer stops growing. */
+  (void)BIO_reset(kb->mem);
+
+  /* Nothing is ever read from the BIO, so what is pending is all
+     that has been written. */
+  for (i = 0; i < KEYBUILD_NFORMATS; i++) {
+    if (!(formats & KEYBUILD_FORMAT_BIT(i))) continue;
+    start[i] = BIO_pending(kb->mem);
+    if (keybuild_write(kb, pkey, i, kb->mem) == 0) return 0;
+    enc->len[i] = BIO_pending(kb->mem) - start[i];
+  }
+
+  /* Only take pointers once the buffer has stopped moving */
+  (void)BIO_get_mem_data(kb->mem, &data);
+  for (i = 0; i < KEYBUILD_NFORMATS; i++)
+    if (formats & KEYBUILD_FORMAT_BIT(i))
+      enc->data[i] = (const unsigned char *)data + start[i];
+
+  return 1;
+}
+
+/* JWK ------------------------ */
+
+/* Copies of the public values a JWK carries: the modulus and public
+   exponent of an RSA key, or the affine coordinates of the public
+   point of an EC key.  For EC keys *curve is set to the curve's index
+   in keybuild_curves.  Returns 1 on success and 0 on error.
+
+   This one goes through the legacy RSA and EC_KEY structures, and
+   works on every release for keys built either way. */
+static int keybuild_public_values_legacy(EVP_PKEY *pkey, BIGNUM **a,
+					 BIGNUM **b, int *curve)
+{
+  const BIGNUM *n, *e;
+  RSA *rsa;
+  EC_KEY *ec;
+  const EC_GROUP *ecgroup;
+  const EC_POINT *ecpublic;
+  int status = 0;
+
+  switch (EVP_PKEY_base_id(pkey)) {
+  case EVP_PKEY_RSA:
+    rsa = EVP_PKEY_get1_RSA(pkey);
+    if (rsa == NULL) return 0;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    n = rsa->n;
+    e = rsa->e;
+#else
+    RSA_get0_key(rsa, &n, &e, NULL);
+#endif
+    *a = BN_dup(n);
+    *b = BN_dup(e);
+    RSA_free(rsa);
+    return *a != NULL && *b != NULL;
+  case EVP_PKEY_EC:
+    ec = EVP_PKEY_get1_EC_KEY(pkey);
+    if (ec == NULL) return 0;
+    ecgroup = EC_KEY_get0_group(ec);
+    ecpublic = EC_KEY_get0_public_key(ec);
+    for (*curve = 0; keybuild_curves[*curve].nid != NID_undef; (*curve)++)
+      if (keybuild_curves[*curve].nid == EC_GROUP_get_curve_name(ecgroup))
+	break;
+    *a = BN_new();
+    *b = BN_new();
+    if (keybuild_curves[*curve].nid != NID_undef
+	&& *a != NULL && *b != NULL && ecpublic != NULL
+	&& !EC_POINT_is_at_infinity(ecgroup, ecpublic))
+      status = EC_POINT_get_affine_coordinates_GFp(ecgroup, ecpublic,
+						   *a, *b, NULL);
+    EC_KEY_free(ec);
+    return status;
+  default:
+    return 0;
+  }
+}
+
+#ifdef KEYBUILD_OSSL3
+/* The same through provider parameters, for keys built with
+   EVP_PKEY_fromdata().  A legacy EC_KEY does not answer for its
+   group name this way. */
+static int keybuild_public_values_fromdata(EVP_PKEY *pkey, BIGNUM **a,
+					   BIGNUM **b, int *curve)
+{
+  char group[80];
+  int nid;
+
+  switch (EVP_PKEY_base_id(pkey)) {
+  case EVP_PKEY_RSA:
+    return EVP_PKEY_get_bn_param(pkey, OSSL_PKEY_PARAM_RSA_N, a)
+      && EVP_PKEY_get_bn_param(pkey, OSSL_PKEY_PARAM_RSA_E, b);
+  case EVP_PKEY_EC:
+    if (!EVP_PKEY_get_utf8_string_param(pkey, OSSL_PKEY_PARAM_GROUP_NAME,
+					group, sizeof(group), NULL))
+      return 0;
+    nid = OBJ_sn2nid(group);
+    if (nid == NID_undef) nid = EC_curve_nist2nid(group);
+    for (*curve = 0; keybuild_curves[*curve].nid != NID_undef; (*curve)++)
+      if (keybuild_curves[*curve].nid == nid) break;
+    if (keybuild_curves[*curve].nid == NID_undef) return 0;
+    /* Fails for the point at infinity, which has no JWK either */
+    return EVP_PKEY_get_bn_param(pkey, OSSL_PKEY_PARAM_EC_PUB_X, a)
+      && EVP_PKEY_get_bn_param(pkey, OSSL_PKEY_PARAM_EC_PUB_Y, b);
+  default:
+    return 0;
+  }
+}
+#endif
+
+/* Write ,"name":"value" with the value big endian, left padded with
+   zeroes to padlen bytes if that is not zero, in unpadded base64url
+   (RFC 7515 section 2). */
+static int keybuild_jwk_member(BIO *out, const char *name,
+			       const BIGNUM *bn, int padlen)
+{
+  unsigned char *bin, *b64;
+  int len, nbytes, b64len, i, status = 0;
+
+  nbytes = BN_num_bytes(bn);
+  len = padlen ? padlen : nbytes;
+  if (len == 0) len = 1;
+  if (nbytes > len) return 0;
+  bin = OPENSSL_malloc(len);
+  b64 = OPENSSL_malloc(4 * ((len + 2) / 3) + 1);
+  if (bin == NULL || b64 == NULL) goto done;
+  /* BN_bn2binpad() only appeared in 1.1 */
+  memset(bin, 0, len - nbytes);
+  BN_bn2bin(bn, bin + len - nbytes);
+
+  b64len = EVP_EncodeBlock(b64, bin, len);
+  while (b64len > 0 && b64[b64len - 1] == '=')
+    b64len--;
+  for (i = 0; i < b64len; i++) {
+    if (b64[i] == '+') b64[i] = '-';
+    else if (b64[i] == '/') b64[i] = '_';
+  }
+  b64[b64len] = '\0';
+  status = BIO_printf(out, ",\"%s\":\"%s\"", name, b64) > 0;
+
+ done:
+  OPENSSL_free(bin);
+  OPENSSL_free(b64);
+  return status;
+}
+
+/* A public JWK.  The tag has no place in a JWK, and a private JWK
+   with made up CRT values would only invite software to try signing
+   with it, so this is the one format in which a reference key is
+   just its public half.  JWK has no DSA key type.  fromdata says
+   which way the key was built. */
+static int keybuild_write_jwk(EVP_PKEY *pkey, BIO *out, int fromdata)
+{
+  BIGNUM *a = NULL, *b = NULL;
+  int curve = 0, status = 0;
+
+  if (EVP_PKEY_base_id(pkey) != EVP_PKEY_RSA
+      && EVP_PKEY_base_id(pkey) != EVP_PKEY_EC) {
+    ERR_put_error(ERR_LIB_EVP, 0, EVP_R_UNSUPPORTED_ALGORITHM,
+		  __FILE__, __LINE__);
+    return 0;
+  }
+#ifdef KEYBUILD_OSSL3
+  if (fromdata)
+    status = keybuild_public_values_fromdata(pkey, &a, &b, &curve);
+  else
+#endif
+    status = keybuild_public_values_legacy(pkey, &a, &b, &curve);
+  if (!status) goto done;
+
+  if (EVP_PKEY_base_id(pkey) == EVP_PKEY_RSA)
+    status = BIO_printf(out, "{\"kty\":\"RSA\"") > 0
+      && keybuild_jwk_member(out, "n", a, 0)
+      && keybuild_jwk_member(out, "e", b, 0);
+  else
+    status = BIO_printf(out, "{\"kty\":\"EC\",\"crv\":\"%s\"",
+			keybuild_curves[curve].jwkname) > 0
+      && keybuild_jwk_member(out, "x", a, keybuild_curves[curve].fieldbytes)
+      && keybuild_jwk_member(out, "y", b, keybuild_curves[curve].fieldbytes);
+  status = status && BIO_printf(out, "}\n") > 0;
+
+ done:
+  BN_free(a);
+  BN_free(b);
+  return status;
+}
+
+/* Legacy code path ------------------------ */
+
+EVP_PKEY *keybuild_rsa_legacy(const BIGNUM *n, const BIGNUM *e,
+			      const BIGNUM *tag)
+{
+  EVP_PKEY *pkey;
+  RSA *rsa;
+
+  pkey = EVP_PKEY_new();
+  if (pkey == NULL) return NULL;
+  rsa = RSA_new();
+  if (rsa == NULL) {
+    EVP_PKEY_free(pkey);
+    return NULL;
+  }
+  /* Assign the appropriate key values: n, e and a dummy d.  Contrary
+     to RSA(3) documentation, openssl rsa won't read the PEM file
+     unless p is set.  Set it to the key modulus just like the
+     embedsavefile does, q and the CRT exponents to 1, and the
+     coefficient to the tag. */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  rsa->n = BN_dup(n);
+  rsa->e = BN_dup(e);
+  rsa->d = BN_dup(tag);
+  rsa->p = BN_dup(n);
+  rsa->q = BN_dup(BN_value_one());
+  rsa->dmp1 = BN_dup(BN_value_one());
+  rsa->dmq1 = BN_dup(BN_value_one());
+  rsa->iqmp = BN_dup(tag);
+#else
+  RSA_set0_key(rsa, BN_dup(n), BN_dup(e), BN_dup(tag));
+  RSA_set0_factors(rsa, BN_dup(n), BN_dup(BN_value_one()));
+  RSA_set0_crt_params(rsa, BN_dup(BN_value_one()), BN_dup(BN_value_one()),
+		      BN_dup(tag));
+#endif
+  if (EVP_PKEY_assign_RSA(pkey, rsa) == 0) {
+    RSA_free(rsa);
+    EVP_PKEY_free(pkey);
+    return NULL;
+  }
+
+  return pkey;
+}
+
+EVP_PKEY *keybuild_dsa_legacy(const BIGNUM *p, const BIGNUM *q,
+			      const BIGNUM *g, const BIGNUM *y,
+			      const BIGNUM *tag)
+{
+  EVP_PKEY *pkey;
+  DSA *dsa;
+
+  pkey = EVP_PKEY_new();
+  if (pkey == NULL) return NULL;
+  dsa = DSA_new();
+  if (dsa == NULL) {
+    EVP_PKEY_free(pkey);
+    return NULL;
+  }
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  dsa->p = BN_dup(p);
+  dsa->q = BN_dup(q);
+  dsa->g = BN_dup(g);
+  dsa->pub_key = BN_dup(y);
+  dsa->priv_key = BN_dup(tag);
+#else
+  DSA_set0_pqg(dsa, BN_dup(p), BN_dup(q), BN_dup(g));
+  DSA_set0_key(dsa, BN_dup(y), BN_dup(tag));
+#endif
+  if (EVP_PKEY_assign_DSA(pkey, dsa) == 0) {
+    DSA_free(dsa);
+    EVP_PKEY_free(pkey);
+    return NULL;
+  }
+
+  return pkey;
+}
+
+EVP_PKEY *keybuild_ec_legacy(int nid,
+			     const BIGNUM *x, const BIGNUM *y,
+			     const BIGNUM *tag)
+{
+  EVP_PKEY *pkey = NULL;
+  EC_KEY *ec = NULL;
+  EC_GROUP *ecgroup = NULL;
+  EC_POINT *ecpublic = NULL;
+  BN_CTX *bnctx = NULL;
+
+  ecgroup = EC_GROUP_new_by_curve_name(nid);
+  if (ecgroup == NULL) goto cleanup;
+  EC_GROUP_set_asn1_flag(ecgroup, OPENSSL_EC_NAMED_CURVE);
+  ec = EC_KEY_new();
+  if (ec == NULL) goto cleanup;
+  if (EC_KEY_set_group(ec, ecgroup) == 0) goto cleanup;
+  if (EC_KEY_set_private_key(ec, tag) == 0) goto cleanup;
+
+  ecpublic = EC_POINT_new(ecgroup);
+  if (ecpublic == NULL) goto cleanup;
+  if (x == NULL || y == NULL) {
+    /* I don't know if key points are ever at Infinity. */
+    if (EC_POINT_set_to_infinity(ecgroup, ecpublic) == 0) goto cleanup;
+  } else {
+    /* TODO once we support non-primary curves, we need to
+       distinguish the curve type here and call the right assignment
+       function */
+    bnctx = BN_CTX_new();
+    if (bnctx == NULL) goto cleanup;
+    if (EC_POINT_set_affine_coordinates_GFp(ecgroup, ecpublic, x, y,
+					    bnctx) == 0)
+      goto cleanup;
+  }
+  if (EC_KEY_set_public_key(ec, ecpublic) == 0) goto cleanup;
+
+  pkey = EVP_PKEY_new();
+  if (pkey == NULL) goto cleanup;
+  if (EVP_PKEY_assign_EC_KEY(pkey, ec) == 0) {
+    EVP_PKEY_free(pkey);
+    pkey = NULL;
+    goto cleanup;
+  }
+  ec = NULL; /* Now owned by pkey */
+
+ cleanup:
+  BN_CTX_free(bnctx);
+  EC_POINT_free(ecpublic);
+  EC_KEY_free(ec);
+  EC_GROUP_free(ecgroup);
+
+  return pkey;
+}
+
+int keybuild_write_legacy(EVP_PKEY *pkey, enum keybuild_format format,
+			  BIO *out)
+{
+  switch (format) {
+  case KEYBUILD_PKCS8_PEM:
+    return PEM_write_bio_PKCS8PrivateKey(out, pkey, NULL, NULL, 0,
+					 NULL, NULL);
+  case KEYBUILD_TRAD_PEM:
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    /* Before 1.1 this is what PEM_write_bio_PrivateKey() writes */
+    return PEM_write_bio_PrivateKey(out, pkey, NULL, NULL, 0, NULL, NULL);
+#else
+    return PEM_write_bio_PrivateKey_traditional(out, pkey, NULL, NULL, 0,
+						NULL, NULL);
+#endif
+  case KEYBUILD_PKCS8_DER:
+    return i2d_PKCS8PrivateKey_bio(out, pkey, NULL, NULL, 0, NULL, NULL);
+  case KEYBUILD_SPKI_PEM:
+    return PEM_write_bio_PUBKEY(out, pkey);
+  case KEYBUILD_JWK:
+    return keybuild_write_jwk(pkey, out, 0);
+  default:
+    return 0;
+  }
+}
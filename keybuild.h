@@ -0,0 +1,167 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef KEYBUILD_H
+#define KEYBUILD_H
+
+#include <openssl/opensslv.h>
+#include <openssl/bio.h>
+#include <openssl/bn.h>
+#include <openssl/evp.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#define KEYBUILD_OSSL3 1
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* Key types we know how to build a reference key for. */
+  enum keybuild_type {
+    KEYBUILD_RSA = 0,
+    KEYBUILD_DSA,
+    KEYBUILD_EC,
+    KEYBUILD_NTYPES
+  };
+
+  /* Output formats.  All but KEYBUILD_SPKI_PEM and KEYBUILD_JWK
+   * carry the tag in the private key fields; those two only have the
+   * public values.  JWK has no key type for DSA. */
+  enum keybuild_format {
+    KEYBUILD_PKCS8_PEM = 0,  /* PKCS#8 PrivateKeyInfo, PEM */
+    KEYBUILD_TRAD_PEM,       /* "BEGIN RSA PRIVATE KEY" and friends */
+    KEYBUILD_PKCS8_DER,      /* PKCS#8 PrivateKeyInfo, DER */
+    KEYBUILD_SPKI_PEM,       /* SubjectPublicKeyInfo, PEM */
+    KEYBUILD_JWK,            /* JSON Web Key, RFC 7517 */
+    KEYBUILD_NFORMATS
+  };
+
+#define KEYBUILD_FORMAT_BIT(format) (1u << (format))
+
+  /* How keys are built and encoded.  KEYBUILD_LEGACY fills in the
+   * RSA, DSA and EC_KEY structures and writes them with the PEM and
+   * i2d functions; it works with every OpenSSL release.
+   * KEYBUILD_FROMDATA (OpenSSL 3 only) goes through OSSL_PARAM,
+   * EVP_PKEY_fromdata() and an OSSL_ENCODER_CTX per key and format.
+   * The latter is many times slower, mostly because each encoder
+   * context has to be created afresh for its key (see
+   * benchkeybuild), so legacy is the default. */
+  enum keybuild_method {
+    KEYBUILD_LEGACY = 0,
+    KEYBUILD_FROMDATA
+  };
+
+  /* Reusable state for building and writing a batch of keys: the
+   * method, on OpenSSL 3 an EVP_PKEY_CTX per key type initialised for
+   * EVP_PKEY_fromdata() once and reused for every key of that type,
+   * and the buffer keybuild_encode() encodes into.  Not thread safe:
+   * use one per thread.
+   */
+  struct keybuild_ctx;
+
+  /* A new context uses KEYBUILD_LEGACY. */
+  extern struct keybuild_ctx *keybuild_ctx_new(void);
+  extern void keybuild_ctx_free(struct keybuild_ctx *kb);
+
+  /* Returns 1 on success, and 0 if the method is not available in
+   * this build.  Keys must be written with the method they were built
+   * with. */
+  extern int keybuild_ctx_set_method(struct keybuild_ctx *kb,
+				     enum keybuild_method method);
+
+  /* "legacy" or, on OpenSSL 3, "fromdata"; -1 for anything else. */
+  extern int keybuild_method_byname(const char *name);
+
+  /* Build a reference key from the public values exported by the
+   * HSM, with the tag standing in for all private values.  None of
+   * the BIGNUMs are consumed or retained: the returned key is
+   * independent of them and must be released with EVP_PKEY_free().
+   * With KEYBUILD_FROMDATA the values go straight from the BIGNUMs
+   * into an OSSL_PARAM array for EVP_PKEY_fromdata(); otherwise the
+   * legacy RSA/DSA/EC_KEY structures are filled in.  Returns NULL on
+   * error, with details on the OpenSSL error stack.
+   */
+  extern EVP_PKEY *keybuild_rsa(struct keybuild_ctx *kb,
+				const BIGNUM *n, const BIGNUM *e,
+				const BIGNUM *tag);
+
+  extern EVP_PKEY *keybuild_dsa(struct keybuild_ctx *kb,
+				const BIGNUM *p, const BIGNUM *q,
+				const BIGNUM *g, const BIGNUM *y,
+				const BIGNUM *tag);
+
+  /* nid is the OpenSSL curve NID; x and y are the affine coordinates
+   * of the public point, or both NULL for the point at infinity. */
+  extern EVP_PKEY *keybuild_ec(struct keybuild_ctx *kb, int nid,
+			       const BIGNUM *x, const BIGNUM *y,
+			       const BIGNUM *tag);
+
+  /* Write pkey to out in the requested format.  Returns 1 on success
+   * and 0 on error, like OpenSSL. */
+  extern int keybuild_write(struct keybuild_ctx *kb, EVP_PKEY *pkey,
+			    enum keybuild_format format, BIO *out);
+
+  /* The encoded forms of one key.  data[format] is NULL for formats
+   * that were not asked for. */
+  struct keybuild_encoded {
+    const unsigned char *data[KEYBUILD_NFORMATS];
+    size_t len[KEYBUILD_NFORMATS];
+  };
+
+  /* Encode pkey in every format whose KEYBUILD_FORMAT_BIT is set in
+   * formats, one after the other into a single buffer held by kb, so
+   * that asking for another format costs one more encoding and
+   * nothing else.  The results point into that buffer and stay valid
+   * until the next call with the same kb.  Returns 1 on success and
+   * 0 on error. */
+  extern int keybuild_encode(struct keybuild_ctx *kb, EVP_PKEY *pkey,
+			     unsigned int formats,
+			     struct keybuild_encoded *enc);
+
+  /* Short names for the formats, for command lines ("pkcs8", "pem",
+   * "der", "spki", "jwk"), and the suffix to give a file holding
+   * each.  keybuild_format_byname() returns -1 for an unknown name. */
+  extern const char *keybuild_format_name(enum keybuild_format format);
+  extern const char *keybuild_format_suffix(enum keybuild_format format);
+  extern int keybuild_format_byname(const char *name);
+
+  /* The KEYBUILD_LEGACY code path on its own, without a context. */
+  extern EVP_PKEY *keybuild_rsa_legacy(const BIGNUM *n, const BIGNUM *e,
+				       const BIGNUM *tag);
+  extern EVP_PKEY *keybuild_dsa_legacy(const BIGNUM *p, const BIGNUM *q,
+				       const BIGNUM *g, const BIGNUM *y,
+				       const BIGNUM *tag);
+  extern EVP_PKEY *keybuild_ec_legacy(int nid,
+				      const BIGNUM *x, const BIGNUM *y,
+				      const BIGNUM *tag);
+  extern int keybuild_write_legacy(EVP_PKEY *pkey,
+				   enum keybuild_format format, BIO *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* KEYBUILD_H */
+#endif
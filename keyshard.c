@@ -0,0 +1,242 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "keyshard.h"
+
+#define KEYSHARD_MAGIC "key-reference-inventory"
+#define KEYSHARD_VERSION 1
+
+uint64_t keyshard_hash(const char *appname, const char *ident)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  const unsigned char *p;
+
+  for (p = (const unsigned char *)appname; *p; p++) {
+    h ^= *p;
+    h *= 0x100000001b3ULL;
+  }
+  /* Separator, so that "ab"/"c" and "a"/"bc" differ */
+  h *= 0x100000001b3ULL;
+  for (p = (const unsigned char *)ident; *p; p++) {
+    h ^= *p;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+int keyshard_parse(const char *spec, struct keyshard *shard)
+{
+  char *end;
+  long index, count;
+
+  errno = 0;
+  index = strtol(spec, &end, 10);
+  if (end == spec || *end != '/' || errno) return -1;
+  spec = end + 1;
+  count = strtol(spec, &end, 10);
+  if (end == spec || *end != '\0' || errno) return -1;
+  if (count < 1 || count > 65536 || index < 0 || index >= count) return -1;
+
+  shard->index = index;
+  shard->count = count;
+  return 0;
+}
+
+int keyshard_owns(const struct keyshard *shard,
+		  const char *appname, const char *ident)
+{
+  if (shard->count <= 1) return 1;
+  return keyshard_hash(appname, ident) % shard->count
+    == (uint64_t)shard->index;
+}
+
+/* Inventories ------------------------ */
+
+/* Indexed by enum keyshard_status */
+static const char *keyshard_statusnames[] = { "failed", "ok", "skipped" };
+
+int keyshard_write_header(FILE *out, const struct keyshard *shard,
+			  long worldkeys, uint64_t worlddigest)
+{
+  if (fprintf(out, "%s %d\nshard %d %d\nworld %ld %016" PRIx64 "\n",
+	      KEYSHARD_MAGIC, KEYSHARD_VERSION, shard->index, shard->count,
+	      worldkeys, worlddigest) < 0)
+    return -1;
+  return 0;
+}
+
+int keyshard_write_entry(FILE *out, enum keyshard_status status,
+			 const char *appname, const char *ident,
+			 char *const *files, int nfiles)
+{
+  int i;
+
+  if (fprintf(out, "%s %s %s", keyshard_statusnames[status], appname,
+	      ident) < 0)
+    return -1;
+  for (i = 0; i < nfiles; i++)
+    if (fprintf(out, " %s", files[i]) < 0) return -1;
+  if (fputc('\n', out) == EOF) return -1;
+  return 0;
+}
+
+static void keyshard_free_entry(struct keyshard_entry *entry)
+{
+  int i;
+
+  free(entry->appname);
+  free(entry->ident);
+  for (i = 0; i < entry->nfiles; i++)
+    free(entry->files[i]);
+  free(entry->files);
+}
+
+/* Split one key line into entry.  The line is modified. */
+static int keyshard_parse_entry(char *line, struct keyshard_entry *entry)
+{
+  char *word, *save = NULL, **files;
+  int field = 0, status;
+
+  memset(entry, 0, sizeof(*entry));
+  for (word = strtok_r(line, " \t\n", &save); word;
+       word = strtok_r(NULL, " \t\n", &save), field++) {
+    switch (field) {
+    case 0:
+      for (status = KEYSHARD_FAILED; status <= KEYSHARD_SKIPPED; status++)
+	if (strcmp(word, keyshard_statusnames[status]) == 0) break;
+      if (status > KEYSHARD_SKIPPED) return -1;
+      entry->status = status;
+      break;
+    case 1:
+      if ((entry->appname = strdup(word)) == NULL) return -1;
+      break;
+    case 2:
+      if ((entry->ident = strdup(word)) == NULL) return -1;
+      break;
+    default:
+      files = realloc(entry->files, (entry->nfiles + 1) * sizeof(*files));
+      if (files == NULL) return -1;
+      entry->files = files;
+      if ((files[entry->nfiles] = strdup(word)) == NULL) return -1;
+      entry->nfiles++;
+      break;
+    }
+  }
+  return field >= 3 ? 0 : -1;
+}
+
+int keyshard_read_inventory(const char *path,
+			    struct keyshard_inventory **inv_r)
+{
+  struct keyshard_inventory *inv;
+  struct keyshard_entry *entries;
+  FILE *f;
+  char *line = NULL;
+  size_t linesize = 0;
+  int lineno = 0, version, size = 0;
+  int rc = -1;
+
+  f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  inv = calloc(1, sizeof(*inv));
+  if (inv == NULL) goto nomem;
+
+  while (getline(&line, &linesize, f) != -1) {
+    lineno++;
+    switch (lineno) {
+    case 1:
+      if (strncmp(line, KEYSHARD_MAGIC " ", strlen(KEYSHARD_MAGIC) + 1) != 0
+	  || sscanf(line + strlen(KEYSHARD_MAGIC), "%d", &version) != 1) {
+	fprintf(stderr, "%s is not an inventory\n", path);
+	goto cleanup;
+      }
+      if (version != KEYSHARD_VERSION) {
+	fprintf(stderr, "%s: unsupported inventory version %d\n", path,
+		version);
+	goto cleanup;
+      }
+      continue;
+    case 2:
+      if (sscanf(line, "shard %d %d", &inv->shard.index,
+		 &inv->shard.count) != 2
+	  || inv->shard.count < 1 || inv->shard.index < 0
+	  || inv->shard.index >= inv->shard.count)
+	goto malformed;
+      continue;
+    case 3:
+      if (sscanf(line, "world %ld %" SCNx64, &inv->worldkeys,
+		 &inv->worlddigest) != 2)
+	goto malformed;
+      continue;
+    }
+    if (inv->nentries == size) {
+      size = size ? 2 * size : 256;
+      entries = realloc(inv->entries, size * sizeof(*entries));
+      if (entries == NULL) goto nomem;
+      inv->entries = entries;
+    }
+    if (keyshard_parse_entry(line, &inv->entries[inv->nentries]) != 0) {
+      keyshard_free_entry(&inv->entries[inv->nentries]);
+      goto malformed;
+    }
+    inv->nentries++;
+  }
+  if (lineno < 3) goto malformed;
+  rc = 0;
+  goto cleanup;
+
+ malformed:
+  fprintf(stderr, "%s:%d: malformed inventory line\n", path, lineno);
+  goto cleanup;
+ nomem:
+  fprintf(stderr, "Out of memory reading %s\n", path);
+ cleanup:
+  free(line);
+  fclose(f);
+  if (rc) {
+    keyshard_free_inventory(inv);
+    return rc;
+  }
+  *inv_r = inv;
+  return 0;
+}
+
+void keyshard_free_inventory(struct keyshard_inventory *inv)
+{
+  int i;
+
+  if (!inv) return;
+  for (i = 0; i < inv->nentries; i++)
+    keyshard_free_entry(&inv->entries[i]);
+  free(inv->entries);
+  free(inv);
+}
@@ -0,0 +1,124 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef KEYSHARD_H
+#define KEYSHARD_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* Splitting a Security World's keys over several hosts.  Shard i of
+   * N (0 <= i < N) owns the keys whose keyshard_hash() is i modulo N.
+   * The hash only depends on the appname and ident, so every host
+   * running the same world agrees on who owns which key without
+   * talking to the others, and the N slices are disjoint and cover
+   * the whole world.
+   *
+   * Each shard's output directory gets an inventory listing every key
+   * in its slice and what became of it, so that krmerge can put the
+   * slices back together and tell if any key went missing or was
+   * exported twice.
+   */
+  struct keyshard {
+    int index;  /* 0 .. count - 1 */
+    int count;  /* 1 for the whole world */
+  };
+
+  /* Stable 64 bit FNV-1a hash of appname and ident.  Does not change
+   * between runs, hosts or releases: shard assignments depend on it. */
+  extern uint64_t keyshard_hash(const char *appname, const char *ident);
+
+  /* Parse "i/N".  Returns 0 on success and -1 if spec is not of that
+   * form with 0 <= i < N. */
+  extern int keyshard_parse(const char *spec, struct keyshard *shard);
+
+  extern int keyshard_owns(const struct keyshard *shard,
+			   const char *appname, const char *ident);
+
+  /* Inventories ------------------------
+   *
+   * A text file, one record per line:
+   *
+   *   key-reference-inventory 1
+   *   shard <i> <N>
+   *   world <number of keys> <digest>
+   *   <ok|failed|skipped> <appname> <ident> [<file> ...]
+   *
+   * The world line describes every key the shard was asked to share
+   * out, not only its own slice: the digest is the sum of their
+   * keyshard_hash() values, in hex, so that shards which read
+   * different key management data or batch files can be told apart.
+   * A skipped key is one that has no reference key, such as a
+   * symmetric key: it is accounted for, but has no files.  File names
+   * are relative to the directory holding the inventory.
+   */
+
+#define KEYSHARD_INVENTORY "inventory"
+
+  enum keyshard_status {
+    KEYSHARD_FAILED = 0,
+    KEYSHARD_OK,
+    KEYSHARD_SKIPPED
+  };
+
+  struct keyshard_entry {
+    char *appname;
+    char *ident;
+    enum keyshard_status status;
+    int nfiles;
+    char **files;
+  };
+
+  struct keyshard_inventory {
+    struct keyshard shard;
+    long worldkeys;
+    uint64_t worlddigest;
+    int nentries;
+    struct keyshard_entry *entries;
+  };
+
+  /* Writing is done a line at a time as keys are exported.  Both
+   * return 0 on success and -1 on error, with errno set. */
+  extern int keyshard_write_header(FILE *out, const struct keyshard *shard,
+				   long worldkeys, uint64_t worlddigest);
+  extern int keyshard_write_entry(FILE *out, enum keyshard_status status,
+				  const char *appname, const char *ident,
+				  char *const *files, int nfiles);
+
+  /* Read a whole inventory.  Returns 0 on success, or -1 having said
+   * what was wrong on stderr. */
+  extern int keyshard_read_inventory(const char *path,
+				     struct keyshard_inventory **inv_r);
+  extern void keyshard_free_inventory(struct keyshard_inventory *inv);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* KEYSHARD_H */
+#endif
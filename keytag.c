@@ -0,0 +1,151 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#include <openssl/crypto.h>
+
+#include "keytag.h"
+
+/* Identifier at the start of a version 1 tag.  Length should be 10,
+   and it is followed by its trailing \0. */
+#define TAG "NFKM Hash:"
+#define TAGLEN (sizeof(TAG))
+
+/* Whimsy: all unused bytes are set to 42 (0x2a, which is the
+   universal Answer to the question of Life, the Universe, and
+   Everything) so they are easily distinguished. */
+#define KEYTAG_PAD 42
+
+static const unsigned char keytag_v2_magic[3] = { 'N', 'K', KEYTAG_V2 };
+
+static unsigned keytag_fletcher16(const unsigned char *header,
+				  const unsigned char *hash, int hashlen)
+{
+  unsigned sum1 = 0, sum2 = 0;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    sum1 = (sum1 + header[i]) % 255;
+    sum2 = (sum2 + sum1) % 255;
+  }
+  for (i = 0; i < hashlen; i++) {
+    sum1 = (sum1 + hash[i]) % 255;
+    sum2 = (sum2 + sum1) % 255;
+  }
+  return (sum2 << 8) | sum1;
+}
+
+static int keytag_v2_hashlen(size_t len)
+{
+  return len - KEYTAG_V2_HEADERLEN < KEYTAG_HASHLEN ?
+    (int)(len - KEYTAG_V2_HEADERLEN) : KEYTAG_HASHLEN;
+}
+
+int keytag_encode(unsigned char *buf, size_t len, int version,
+		  int keytype, const unsigned char *hash)
+{
+  unsigned checksum;
+  int hashlen;
+
+  switch (version) {
+  case KEYTAG_V1:
+    /* Leading tag is 11 bytes including trailing \0.  NFKM Hash is
+       20 bytes.  Add a trailing \0 after the NFKM hash.  This means
+       our minimum length is 32 bytes. */
+    if (len < KEYTAG_V1_MINLEN) return -1;
+    memset(buf, KEYTAG_PAD, len);
+    memcpy(buf, TAG, TAGLEN);
+    memcpy(buf + TAGLEN, hash, KEYTAG_HASHLEN);
+    buf[TAGLEN + KEYTAG_HASHLEN] = 0;
+    return 0;
+  case KEYTAG_V2:
+    if (len < KEYTAG_V2_MINLEN) return -1;
+    if (keytype < 0 || keytype > 15) return -1;
+    hashlen = keytag_v2_hashlen(len);
+    memset(buf, KEYTAG_PAD, len);
+    memcpy(buf, keytag_v2_magic, sizeof(keytag_v2_magic));
+    buf[3] = (keytype << 4) | KEYTAG_HASH_NFKM_SHA1;
+    memcpy(buf + KEYTAG_V2_HEADERLEN, hash, hashlen);
+    checksum = keytag_fletcher16(buf, hash, hashlen);
+    buf[4] = checksum >> 8;
+    buf[5] = checksum & 0xff;
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+int keytag_decode(const unsigned char *buf, size_t len,
+		  struct keytag_info *info)
+{
+  if (len >= KEYTAG_V2_MINLEN
+      && memcmp(buf, keytag_v2_magic, sizeof(keytag_v2_magic)) == 0) {
+    info->version = KEYTAG_V2;
+    info->keytype = buf[3] >> 4;
+    info->hashalg = buf[3] & 0x0f;
+    info->hashlen = keytag_v2_hashlen(len);
+    if (info->hashalg != KEYTAG_HASH_NFKM_SHA1) return 0;
+    if (keytag_fletcher16(buf, buf + KEYTAG_V2_HEADERLEN, info->hashlen)
+	!= (unsigned)((buf[4] << 8) | buf[5]))
+      return 0;
+    memcpy(info->hash, buf + KEYTAG_V2_HEADERLEN, info->hashlen);
+    return KEYTAG_V2;
+  }
+
+  if (len >= KEYTAG_V1_MINLEN
+      && memcmp(buf, TAG, TAGLEN) == 0
+      && buf[TAGLEN + KEYTAG_HASHLEN] == 0) {
+    info->version = KEYTAG_V1;
+    info->keytype = KEYTAG_KEY_UNKNOWN;
+    info->hashalg = KEYTAG_HASH_NFKM_SHA1;
+    info->hashlen = KEYTAG_HASHLEN;
+    memcpy(info->hash, buf + TAGLEN, KEYTAG_HASHLEN);
+    return KEYTAG_V1;
+  }
+
+  return 0;
+}
+
+int keytag_decode_bn(const BIGNUM *bn, struct keytag_info *info)
+{
+  /* Room for the private exponent of an 8192 bit RSA key without
+     going to the heap. */
+  unsigned char stackbuf[512];
+  unsigned char *buf = stackbuf;
+  int len, version;
+
+  len = BN_num_bytes(bn);
+  if (len < KEYTAG_V2_MINLEN) return 0;
+  if (len > (int)sizeof(stackbuf)) {
+    buf = OPENSSL_malloc(len);
+    if (buf == NULL) return 0;
+  }
+  BN_bn2bin(bn, buf);
+  version = keytag_decode(buf, len, info);
+  if (buf != stackbuf)
+    OPENSSL_free(buf);
+
+  return version;
+}
@@ -0,0 +1,110 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef KEYTAG_H
+#define KEYTAG_H
+
+#include <stddef.h>
+
+#include <openssl/bn.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* The tag is what we put in place of the private key value(s) of a
+   * reference key, so the key can be traced back to the Security
+   * World key it stands for.  Two layouts exist, both read from the
+   * most significant byte of the value.
+   *
+   * Version 1, at least 32 bytes:
+   *
+   *   "NFKM Hash:" \0 <20 byte NFKM hash> \0 <0x2a padding>
+   *
+   * Version 2, at least KEYTAG_V2_MINLEN bytes:
+   *
+   *   offset 0  'N' 'K'           magic
+   *   offset 2  0x02              version
+   *   offset 3  type << 4 | alg   key type and hash algorithm
+   *   offset 4  checksum          Fletcher-16 over bytes 0-3 and the
+   *                               hash, most significant byte first
+   *   offset 6  hash              min(20, length - 6) bytes: the
+   *                               leading bytes of the hash when
+   *                               the value is too short for all of it
+   *   then      0x2a padding
+   *
+   * Either can be recognised by looking at a few bytes at fixed
+   * offsets, without searching.
+   */
+
+#define KEYTAG_V1 1
+#define KEYTAG_V2 2
+
+#define KEYTAG_HASHLEN 20
+#define KEYTAG_V1_MINLEN 32
+#define KEYTAG_V2_HEADERLEN 6
+#define KEYTAG_V2_MINHASHLEN 8
+#define KEYTAG_V2_MINLEN (KEYTAG_V2_HEADERLEN + KEYTAG_V2_MINHASHLEN)
+
+  enum keytag_keytype {
+    KEYTAG_KEY_UNKNOWN = 0,
+    KEYTAG_KEY_RSA = 1,
+    KEYTAG_KEY_DSA = 2,
+    KEYTAG_KEY_EC = 3
+  };
+
+  enum keytag_hashalg {
+    KEYTAG_HASH_UNKNOWN = 0,
+    KEYTAG_HASH_NFKM_SHA1 = 1 /* The NFKM key hash (SHA-1) */
+  };
+
+  struct keytag_info {
+    int version;  /* KEYTAG_V1 or KEYTAG_V2 */
+    int keytype;  /* enum keytag_keytype; always unknown for v1 */
+    int hashalg;  /* enum keytag_hashalg */
+    int hashlen;  /* Bytes of hash present, at most KEYTAG_HASHLEN */
+    unsigned char hash[KEYTAG_HASHLEN];
+  };
+
+  /* Fill buf with a tag of exactly len bytes.  Returns 0 on success,
+   * or -1 if the version is unknown or len is too short for it. */
+  extern int keytag_encode(unsigned char *buf, size_t len, int version,
+			   int keytype, const unsigned char *hash);
+
+  /* Recognise and unpack a tag.  Returns the tag version, or 0 if buf
+   * does not hold a valid tag (in which case info is undefined). */
+  extern int keytag_decode(const unsigned char *buf, size_t len,
+			   struct keytag_info *info);
+
+  /* Same for a private value that has been read back as a BIGNUM.
+   * A tag never starts with a zero byte, so nothing is lost in the
+   * conversion. */
+  extern int keytag_decode_bn(const BIGNUM *bn, struct keytag_info *info);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* KEYTAG_H */
+#endif
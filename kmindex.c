@@ -0,0 +1,382 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "keyshard.h"
+#include "kmindex.h"
+
+/* Key files are called key_<appname>_<ident> */
+#define KMINDEX_PREFIX "key_"
+
+/* Slots handed to a parser thread at a time */
+#define KMINDEX_CHUNK 64
+
+struct kmindex_entry {
+  char *appname;     /* NULL for an empty slot; ident shares its block */
+  char *ident;
+  uint64_t hash;
+  int owned;         /* Belongs to the index's shard, so gets parsed */
+  NFKM_Key *key;     /* NULL if the file did not parse */
+  ino_t ino;         /* What the file looked like when it was parsed */
+  off_t size;
+  struct timespec mtime;
+  struct kmindex_entry *prev; /* Same key in the old table, during refresh */
+};
+
+struct kmindex {
+  NFast_AppHandle app;
+  char *dir;
+  struct keyshard shard;
+  size_t mask;       /* Table size is a power of two; this is size - 1 */
+  int count;
+  struct kmindex_entry *slots;
+};
+
+/* Shared by the parser threads of one refresh */
+struct kmindex_scan {
+  struct kmindex *index;
+  struct kmindex_entry *slots;
+  size_t nslots;
+  pthread_mutex_t lock; /* Protects the two below */
+  size_t next;          /* Next slot to hand out */
+  int parsed;
+};
+
+uint64_t kmindex_hash(const char *appname, const char *ident)
+{
+  /* The same hash that assigns keys to shards */
+  return keyshard_hash(appname, ident);
+}
+
+static struct kmindex_entry *kmindex_find(struct kmindex_entry *slots,
+					  size_t mask, uint64_t hash,
+					  const char *appname,
+					  const char *ident)
+{
+  size_t i;
+
+  for (i = hash & mask; slots[i].appname; i = (i + 1) & mask) {
+    if (slots[i].hash == hash
+	&& strcmp(slots[i].appname, appname) == 0
+	&& strcmp(slots[i].ident, ident) == 0)
+      return &slots[i];
+  }
+  return NULL;
+}
+
+static void kmindex_free_slots(NFast_AppHandle app,
+			       struct kmindex_entry *slots, size_t nslots)
+{
+  size_t i;
+
+  if (!slots) return;
+  for (i = 0; i < nslots; i++) {
+    if (!slots[i].appname) continue;
+    if (slots[i].key)
+      NFKM_freekey(app, slots[i].key, NULL);
+    free(slots[i].appname);
+  }
+  free(slots);
+}
+
+static const char *kmindex_default_dir(char *buf, size_t buflen)
+{
+  const char *env;
+
+  if ((env = getenv("NFAST_KMLOCAL")) != NULL)
+    return env;
+  if ((env = getenv("NFAST_KMDATA")) != NULL) {
+    snprintf(buf, buflen, "%s/local", env);
+    return buf;
+  }
+  if ((env = getenv("NFAST_HOME")) != NULL) {
+    snprintf(buf, buflen, "%s/kmdata/local", env);
+    return buf;
+  }
+  return "/opt/nfast/kmdata/local";
+}
+
+/* Stat one key file and parse it, unless the old table has it parsed
+   already and the file has not changed since.  Returns 1 if the file
+   was parsed. */
+static int kmindex_scan_entry(struct kmindex *index,
+			      struct kmindex_entry *entry)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  NFKM_KeyIdent keyident;
+  struct kmindex_entry *prev = entry->prev;
+
+  entry->prev = NULL;
+  snprintf(path, sizeof(path), "%s/" KMINDEX_PREFIX "%s_%s",
+	   index->dir, entry->appname, entry->ident);
+  if (stat(path, &st) != 0) return 0;
+  entry->ino = st.st_ino;
+  entry->size = st.st_size;
+  entry->mtime = st.st_mtim;
+
+  if (prev && prev->key
+      && prev->ino == st.st_ino && prev->size == st.st_size
+      && prev->mtime.tv_sec == st.st_mtim.tv_sec
+      && prev->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+    /* Each old entry is the prev of at most one new one, so this
+       needs no locking. */
+    entry->key = prev->key;
+    prev->key = NULL;
+    return 0;
+  }
+
+  keyident.appname = entry->appname;
+  keyident.ident = entry->ident;
+  if (NFKM_findkey(index->app, keyident, &entry->key, NULL) != Status_OK)
+    entry->key = NULL;
+  return 1;
+}
+
+static void *kmindex_scan_thread(void *arg)
+{
+  struct kmindex_scan *scan = (struct kmindex_scan *)arg;
+  size_t first, i;
+  int parsed = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&scan->lock);
+    first = scan->next;
+    scan->next += KMINDEX_CHUNK;
+    pthread_mutex_unlock(&scan->lock);
+    if (first >= scan->nslots) break;
+
+    for (i = first; i < first + KMINDEX_CHUNK && i < scan->nslots; i++)
+      if (scan->slots[i].appname && scan->slots[i].owned)
+	parsed += kmindex_scan_entry(scan->index, &scan->slots[i]);
+  }
+
+  pthread_mutex_lock(&scan->lock);
+  scan->parsed += parsed;
+  pthread_mutex_unlock(&scan->lock);
+  return NULL;
+}
+
+int kmindex_refresh(struct kmindex *index, int nthreads)
+{
+  DIR *dir;
+  struct dirent *de;
+  char **names = NULL, **newnames;
+  int nnames = 0, maxnames = 0;
+  size_t nslots, mask, i;
+  struct kmindex_entry *slots, *entry;
+  struct kmindex_scan scan;
+  pthread_t *threads;
+  char *sep;
+  int n, started, failed = 0;
+
+  /* Read the directory first, so we know how big a table we need */
+  dir = opendir(index->dir);
+  if (dir == NULL) return -1;
+  for (;;) {
+    /* readdir() returns NULL on error as well as at the end */
+    errno = 0;
+    de = readdir(dir);
+    if (de == NULL) {
+      failed = errno;
+      break;
+    }
+    if (strncmp(de->d_name, KMINDEX_PREFIX, strlen(KMINDEX_PREFIX)) != 0)
+      continue;
+    if (nnames == maxnames) {
+      maxnames = maxnames ? 2*maxnames : 256;
+      newnames = realloc(names, maxnames * sizeof(*names));
+      if (newnames == NULL) {
+	failed = ENOMEM;
+	break;
+      }
+      names = newnames;
+    }
+    names[nnames] = strdup(de->d_name + strlen(KMINDEX_PREFIX));
+    if (names[nnames] == NULL) {
+      failed = ENOMEM;
+      break;
+    }
+    nnames++;
+  }
+  closedir(dir);
+  /* A partial listing would silently lose keys */
+  if (failed) {
+    while (nnames-- > 0)
+      free(names[nnames]);
+    free(names);
+    errno = failed;
+    return -1;
+  }
+
+  /* Keep the load factor at or below one half */
+  for (nslots = 16; nslots < 2 * (size_t)nnames; nslots *= 2)
+    ;
+  mask = nslots - 1;
+  slots = calloc(nslots, sizeof(*slots));
+  if (slots == NULL) {
+    while (nnames-- > 0)
+      free(names[nnames]);
+    free(names);
+    return -1;
+  }
+
+  for (n = 0; n < nnames; n++) {
+    /* Split appname_ident in place; the name block becomes the
+       entry's appname and ident. */
+    sep = strchr(names[n], '_');
+    if (sep == NULL || sep == names[n] || sep[1] == '\0') {
+      free(names[n]);
+      continue;
+    }
+    *sep = '\0';
+    i = kmindex_hash(names[n], sep + 1) & mask;
+    while (slots[i].appname)
+      i = (i + 1) & mask;
+    entry = &slots[i];
+    entry->appname = names[n];
+    entry->ident = sep + 1;
+    entry->hash = kmindex_hash(entry->appname, entry->ident);
+    entry->owned = keyshard_owns(&index->shard, entry->appname,
+				 entry->ident);
+    if (index->slots && entry->owned)
+      entry->prev = kmindex_find(index->slots, index->mask, entry->hash,
+				 entry->appname, entry->ident);
+  }
+  free(names);
+
+  /* Stat and parse in parallel */
+  scan.index = index;
+  scan.slots = slots;
+  scan.nslots = nslots;
+  scan.next = 0;
+  scan.parsed = 0;
+  pthread_mutex_init(&scan.lock, NULL);
+  /* This thread does its share too */
+  started = 0;
+  threads = nthreads > 1 ? calloc(nthreads - 1, sizeof(*threads)) : NULL;
+  if (threads) {
+    for (; started < nthreads - 1; started++)
+      if (pthread_create(&threads[started], NULL, kmindex_scan_thread,
+			 &scan) != 0)
+	break;
+  }
+  /* Whatever could not be handed to a thread gets done here */
+  kmindex_scan_thread(&scan);
+  for (n = 0; n < started; n++)
+    pthread_join(threads[n], NULL);
+  free(threads);
+  pthread_mutex_destroy(&scan.lock);
+
+  /* Anything not taken over from the old table is stale or gone */
+  kmindex_free_slots(index->app, index->slots,
+		     index->slots ? index->mask + 1 : 0);
+  index->slots = slots;
+  index->mask = mask;
+  index->count = 0;
+  for (i = 0; i < nslots; i++)
+    if (slots[i].appname) index->count++;
+
+  return scan.parsed;
+}
+
+M_Status kmindex_build(NFast_AppHandle app, const char *kmlocal,
+		       int nthreads, const struct keyshard *shard,
+		       struct kmindex **index_r)
+{
+  struct kmindex *index;
+  char buf[PATH_MAX];
+
+  *index_r = NULL;
+  index = calloc(1, sizeof(*index));
+  if (index == NULL) return Status_NoHostMemory;
+  index->app = app;
+  index->shard.index = shard ? shard->index : 0;
+  index->shard.count = shard ? shard->count : 1;
+  index->dir = strdup(kmlocal ? kmlocal : kmindex_default_dir(buf,
+							      sizeof(buf)));
+  if (index->dir == NULL) {
+    free(index);
+    return Status_NoHostMemory;
+  }
+
+  if (kmindex_refresh(index, nthreads) < 0) {
+    kmindex_free(index);
+    return Status_OSErrorErrno;
+  }
+
+  *index_r = index;
+  return Status_OK;
+}
+
+void kmindex_free(struct kmindex *index)
+{
+  if (!index) return;
+  kmindex_free_slots(index->app, index->slots,
+		     index->slots ? index->mask + 1 : 0);
+  free(index->dir);
+  free(index);
+}
+
+NFKM_Key *kmindex_lookup(const struct kmindex *index,
+			 NFKM_KeyIdent keyident)
+{
+  struct kmindex_entry *entry;
+
+  entry = kmindex_find(index->slots, index->mask,
+		       kmindex_hash(keyident.appname, keyident.ident),
+		       keyident.appname, keyident.ident);
+  return entry ? entry->key : NULL;
+}
+
+int kmindex_count(const struct kmindex *index)
+{
+  return index->count;
+}
+
+int kmindex_keys(const struct kmindex *index, NFKM_KeyIdent **keys_r)
+{
+  NFKM_KeyIdent *keys;
+  size_t i;
+  int n = 0;
+
+  keys = malloc((index->count ? index->count : 1) * sizeof(*keys));
+  if (keys == NULL) return -1;
+  for (i = 0; index->slots && i <= index->mask; i++) {
+    if (index->slots[i].appname == NULL) continue;
+    keys[n].appname = index->slots[i].appname;
+    keys[n].ident = index->slots[i].ident;
+    n++;
+  }
+  *keys_r = keys;
+  return n;
+}
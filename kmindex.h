@@ -0,0 +1,96 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef KMINDEX_H
+#define KMINDEX_H
+
+#include <stdint.h>
+
+#include <nfkm.h>
+
+#include "keyshard.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* In-memory index of the key files in the kmdata local directory,
+   * from appname/ident to the parsed NFKM_Key (including its public
+   * blob).  The directory is read once and the key files parsed by a
+   * number of threads in parallel; after that a lookup is a hash and
+   * a probe of an open-addressing table, with no filesystem access.
+   *
+   * kmindex_refresh() brings the index up to date with the directory,
+   * re-parsing only the key files that are new or whose size, inode
+   * or modification time changed.  It is meant to be called between
+   * rounds of work by long-running callers: keys handed out by
+   * kmindex_lookup() are owned by the index and are only good until
+   * the next refresh, so the caller must not refresh while a lookup
+   * result is still in use.  Lookups may run concurrently with each
+   * other.
+   *
+   * An index can be limited to one shard of the world: it still lists
+   * every key file by name, but only parses those the shard owns, so
+   * that each of N hosts reads about 1/N of the files.
+   */
+  struct kmindex;
+
+  /* kmlocal may be NULL for the directory NFKM itself would use:
+   * $NFAST_KMLOCAL, $NFAST_KMDATA/local, $NFAST_HOME/kmdata/local or
+   * /opt/nfast/kmdata/local, in that order of preference.  shard may
+   * be NULL for the whole world. */
+  extern M_Status kmindex_build(NFast_AppHandle app, const char *kmlocal,
+				int nthreads, const struct keyshard *shard,
+				struct kmindex **index_r);
+  extern void kmindex_free(struct kmindex *index);
+
+  /* Returns the number of key files parsed, or -1 if the directory
+   * could not be read in full (the index is left as it was). */
+  extern int kmindex_refresh(struct kmindex *index, int nthreads);
+
+  /* NULL if the key is not in the index, belongs to another shard,
+   * or its file could not be parsed. */
+  extern NFKM_Key *kmindex_lookup(const struct kmindex *index,
+				  NFKM_KeyIdent keyident);
+
+  extern int kmindex_count(const struct kmindex *index);
+
+  /* Every key in the index, whether or not its file parsed and
+   * whichever shard it belongs to, in no particular order.  The
+   * strings belong to the index, like lookup results; the caller frees
+   * the array.  Returns the number of keys, or -1 if out of memory. */
+  extern int kmindex_keys(const struct kmindex *index,
+			  NFKM_KeyIdent **keys_r);
+
+  /* Stable 64 bit FNV-1a hash of appname and ident, as used for the
+   * index.  Does not change between runs or hosts; it is the same as
+   * keyshard_hash(). */
+  extern uint64_t kmindex_hash(const char *appname, const char *ident);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* KMINDEX_H */
+#endif
@@ -0,0 +1,450 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Put the output of a sharded export back together.  Each argument is
+ * the output directory of one "key-reference --shard i/N --all dir"
+ * or "key-reference --shard i/N --batch file --outdir dir" run (or the
+ * inventory file in it).  krmerge checks that every shard is there and
+ * that they all saw the same world, then reports every key that no
+ * shard exported and every key that more than one shard exported.
+ * Keys a shard skipped for want of a public half are counted, not
+ * flagged.  With -o it also copies one copy of each exported key
+ * into a single directory, with an inventory for the whole world.
+ *
+ * Exits 0 if the merged result is complete and consistent, 1 if
+ * anything was flagged, and 2 on usage or I/O errors.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "keyshard.h"
+
+/* One inventory, and the directory its file names are relative to */
+struct shard_input {
+  const char *arg;
+  char *dir;
+  struct keyshard_inventory *inv;
+};
+
+/* One line of one inventory */
+struct listing {
+  const struct shard_input *input;
+  const struct keyshard_entry *entry;
+};
+
+static int compare_listings(const void *a, const void *b)
+{
+  const struct listing *x = a, *y = b;
+  int c;
+
+  c = strcmp(x->entry->appname, y->entry->appname);
+  if (c == 0) c = strcmp(x->entry->ident, y->entry->ident);
+  if (c == 0) c = x->input->inv->shard.index - y->input->inv->shard.index;
+  return c;
+}
+
+static int same_key(const struct listing *x, const struct listing *y)
+{
+  return strcmp(x->entry->appname, y->entry->appname) == 0
+    && strcmp(x->entry->ident, y->entry->ident) == 0;
+}
+
+/* Read the inventory named by, or in the directory named by, arg */
+static int read_input(const char *arg, struct shard_input *input)
+{
+  struct stat sb;
+  char *path, *slash;
+
+  input->arg = arg;
+  if (stat(arg, &sb) != 0) {
+    fprintf(stderr, "%s: %s\n", arg, strerror(errno));
+    return -1;
+  }
+  if (S_ISDIR(sb.st_mode)) {
+    input->dir = strdup(arg);
+    if (asprintf(&path, "%s/%s", arg, KEYSHARD_INVENTORY) < 0) path = NULL;
+  } else {
+    path = strdup(arg);
+    input->dir = strdup(arg);
+    if (input->dir) {
+      slash = strrchr(input->dir, '/');
+      if (slash) *slash = '\0';
+      else strcpy(input->dir, ".");
+    }
+  }
+  if (input->dir == NULL || path == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    free(path);
+    return -1;
+  }
+  if (keyshard_read_inventory(path, &input->inv) != 0) {
+    free(path);
+    return -1;
+  }
+  free(path);
+  return 0;
+}
+
+/* Compare two files byte for byte.  Returns 0 if they are the same,
+   1 if they differ and -1 if either could not be read. */
+static int compare_files(const char *a, const char *b)
+{
+  FILE *fa, *fb;
+  int ca, cb, rc = -1;
+
+  fa = fopen(a, "r");
+  fb = fopen(b, "r");
+  if (fa && fb) {
+    do {
+      ca = getc(fa);
+      cb = getc(fb);
+    } while (ca == cb && ca != EOF);
+    rc = ca == cb ? 0 : 1;
+  }
+  if (fa) fclose(fa);
+  if (fb) fclose(fb);
+  return rc;
+}
+
+/* Do the files of two listings of the same key match? */
+static int same_output(const struct listing *x, const struct listing *y)
+{
+  char *a, *b;
+  int i, same;
+
+  if (x->entry->nfiles != y->entry->nfiles) return 0;
+  for (i = 0; i < x->entry->nfiles; i++) {
+    if (strcmp(x->entry->files[i], y->entry->files[i]) != 0) return 0;
+    if (asprintf(&a, "%s/%s", x->input->dir, x->entry->files[i]) < 0)
+      return 0;
+    if (asprintf(&b, "%s/%s", y->input->dir, y->entry->files[i]) < 0) {
+      free(a);
+      return 0;
+    }
+    same = compare_files(a, b) == 0;
+    free(a);
+    free(b);
+    if (!same) return 0;
+  }
+  return 1;
+}
+
+/* Hard link from to to, or copy it if they are on different file
+   systems.  If to already is from, leave it be. */
+static int copy_file(const char *from, const char *to)
+{
+  char buf[65536];
+  struct stat fromsb, tosb;
+  ssize_t n;
+  int in, out, rc = 0;
+
+  if (stat(from, &fromsb) != 0) return -1;
+  if (stat(to, &tosb) == 0 && tosb.st_dev == fromsb.st_dev
+      && tosb.st_ino == fromsb.st_ino)
+    return 0;
+  unlink(to);
+  if (link(from, to) == 0) return 0;
+  in = open(from, O_RDONLY);
+  if (in < 0) return -1;
+  out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out < 0) {
+    close(in);
+    return -1;
+  }
+  while ((n = read(in, buf, sizeof(buf))) > 0)
+    if (write(out, buf, n) != n) {
+      rc = -1;
+      break;
+    }
+  if (n < 0) rc = -1;
+  close(in);
+  if (close(out) != 0) rc = -1;
+  return rc;
+}
+
+/* Copy the files of one listing into outdir */
+static int copy_listing(const struct listing *l, const char *outdir)
+{
+  char *from, *to;
+  int i, rc = 0;
+
+  for (i = 0; i < l->entry->nfiles && rc == 0; i++) {
+    if (asprintf(&from, "%s/%s", l->input->dir, l->entry->files[i]) < 0)
+      return -1;
+    if (asprintf(&to, "%s/%s", outdir, l->entry->files[i]) < 0) {
+      free(from);
+      return -1;
+    }
+    rc = copy_file(from, to);
+    if (rc != 0)
+      fprintf(stderr, "Error copying %s to %s: %s\n", from, to,
+	      strerror(errno));
+    free(from);
+    free(to);
+  }
+  return rc;
+}
+
+/* True if a and b name the same file or directory */
+static int same_file(const char *a, const char *b)
+{
+  struct stat sa, sb;
+
+  return stat(a, &sa) == 0 && stat(b, &sb) == 0
+    && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-o outdir] shard-dir|inventory ...\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+  struct shard_input *inputs;
+  struct listing *listings;
+  struct keyshard whole = { 0, 1 };
+  const char *outdir = NULL;
+  char *path = NULL;
+  FILE *inventory = NULL;
+  int ninputs, nlistings = 0, nshards;
+  int *seen;
+  int i, j, k, opt, ok, skipped, first;
+  enum keyshard_status status;
+  long keys = 0, exported = 0, missing = 0, duplicated = 0, nskipped = 0;
+  uint64_t digest = 0;
+  int flagged = 0;
+
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    switch (opt) {
+    case 'o':
+      outdir = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  ninputs = argc - optind;
+  if (ninputs < 1) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  inputs = calloc(ninputs, sizeof(*inputs));
+  if (inputs == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 2;
+  }
+  for (i = 0; i < ninputs; i++) {
+    if (read_input(argv[optind + i], &inputs[i]) != 0) return 2;
+    nlistings += inputs[i].inv->nentries;
+  }
+
+  /* The shards must be cut the same way from the same world, and all
+     be there, once each. */
+  nshards = inputs[0].inv->shard.count;
+  for (i = 1; i < ninputs; i++) {
+    if (inputs[i].inv->shard.count != nshards) {
+      fprintf(stderr, "%s is shard %d/%d but %s is shard %d/%d\n",
+	      inputs[i].arg, inputs[i].inv->shard.index,
+	      inputs[i].inv->shard.count, inputs[0].arg,
+	      inputs[0].inv->shard.index, nshards);
+      return 2;
+    }
+    if (inputs[i].inv->worldkeys != inputs[0].inv->worldkeys
+	|| inputs[i].inv->worlddigest != inputs[0].inv->worlddigest) {
+      fprintf(stderr, "%s and %s were exported from different sets of "
+	      "keys (%ld and %ld keys)\n", inputs[0].arg, inputs[i].arg,
+	      inputs[0].inv->worldkeys, inputs[i].inv->worldkeys);
+      flagged = 1;
+    }
+  }
+  seen = calloc(nshards, sizeof(*seen));
+  if (seen == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 2;
+  }
+  for (i = 0; i < ninputs; i++)
+    seen[inputs[i].inv->shard.index]++;
+  for (i = 0; i < nshards; i++) {
+    if (seen[i] == 0) {
+      fprintf(stderr, "Shard %d/%d is missing\n", i, nshards);
+      flagged = 1;
+    } else if (seen[i] > 1) {
+      fprintf(stderr, "Shard %d/%d given %d times\n", i, nshards, seen[i]);
+      flagged = 1;
+    }
+  }
+
+  /* Sort every listing by key, and walk through the keys */
+  listings = calloc(nlistings ? nlistings : 1, sizeof(*listings));
+  if (listings == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 2;
+  }
+  nlistings = 0;
+  for (i = 0; i < ninputs; i++)
+    for (j = 0; j < inputs[i].inv->nentries; j++) {
+      listings[nlistings].input = &inputs[i];
+      listings[nlistings].entry = &inputs[i].inv->entries[j];
+      nlistings++;
+    }
+  qsort(listings, nlistings, sizeof(*listings), compare_listings);
+
+  if (outdir) {
+    if (mkdir(outdir, 0777) != 0 && errno != EEXIST) {
+      fprintf(stderr, "Error creating %s: %s\n", outdir, strerror(errno));
+      return 2;
+    }
+    /* Writing the inventory would overwrite the input's own */
+    for (i = 0; i < ninputs; i++)
+      if (same_file(outdir, inputs[i].dir)) {
+	fprintf(stderr, "Output directory %s is input %s\n", outdir,
+		inputs[i].arg);
+	return 2;
+      }
+    if (asprintf(&path, "%s/%s", outdir, KEYSHARD_INVENTORY) < 0
+	|| (inventory = fopen(path, "w")) == NULL
+	|| keyshard_write_header(inventory, &whole,
+				 inputs[0].inv->worldkeys,
+				 inputs[0].inv->worlddigest) != 0) {
+      fprintf(stderr, "Error writing inventory in %s: %s\n", outdir,
+	      strerror(errno));
+      return 2;
+    }
+  }
+
+  for (i = 0; i < nlistings; i = j) {
+    for (j = i + 1; j < nlistings && same_key(&listings[i], &listings[j]);
+	 j++)
+      ;
+    keys++;
+    digest += keyshard_hash(listings[i].entry->appname,
+			    listings[i].entry->ident);
+
+    for (k = i; k < j; k++)
+      if (!keyshard_owns(&listings[k].input->inv->shard,
+			 listings[k].entry->appname,
+			 listings[k].entry->ident))
+	fprintf(stderr, "Warning: app %s ident %s does not belong in "
+		"shard %d/%d\n", listings[k].entry->appname,
+		listings[k].entry->ident,
+		listings[k].input->inv->shard.index, nshards);
+
+    /* The first shard that managed to export the key provides it.  A
+       key without a reference key is skipped, not missing. */
+    first = -1;
+    ok = skipped = 0;
+    for (k = i; k < j; k++) {
+      if (listings[k].entry->status == KEYSHARD_SKIPPED) skipped++;
+      if (listings[k].entry->status != KEYSHARD_OK) continue;
+      ok++;
+      if (first < 0) first = k;
+    }
+
+    if (j - i > 1) {
+      duplicated++;
+      flagged = 1;
+      fprintf(stderr, "Duplicate: app %s ident %s in shards",
+	      listings[i].entry->appname, listings[i].entry->ident);
+      for (k = i; k < j; k++)
+	fprintf(stderr, " %d", listings[k].input->inv->shard.index);
+      for (k = i; k < j; k++)
+	if (k != first && listings[k].entry->status == KEYSHARD_OK
+	    && !same_output(&listings[first], &listings[k]))
+	  break;
+      fprintf(stderr, "%s\n", k < j ? ", with different output" : "");
+    }
+
+    if (ok) {
+      exported++;
+      status = KEYSHARD_OK;
+    } else if (skipped) {
+      nskipped++;
+      status = KEYSHARD_SKIPPED;
+    } else {
+      missing++;
+      flagged = 1;
+      fprintf(stderr, "Missing: app %s ident %s failed in shard %d\n",
+	      listings[i].entry->appname, listings[i].entry->ident,
+	      listings[i].input->inv->shard.index);
+      status = KEYSHARD_FAILED;
+    }
+
+    if (outdir) {
+      if (ok && copy_listing(&listings[first], outdir) != 0) return 2;
+      k = ok ? first : i;
+      if (keyshard_write_entry(inventory, status, listings[k].entry->appname,
+			       listings[k].entry->ident,
+			       ok ? listings[k].entry->files : NULL,
+			       ok ? listings[k].entry->nfiles : 0) != 0) {
+	fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+	return 2;
+      }
+    }
+  }
+
+  /* Keys that are in the world but in no inventory at all can only be
+     counted, not named. */
+  if (keys != inputs[0].inv->worldkeys) {
+    fprintf(stderr, "%ld keys in the world but %ld in the inventories\n",
+	    inputs[0].inv->worldkeys, keys);
+    missing += keys < inputs[0].inv->worldkeys
+      ? inputs[0].inv->worldkeys - keys : 0;
+    flagged = 1;
+  } else if (digest != inputs[0].inv->worlddigest) {
+    fprintf(stderr, "The inventories do not list the same keys as the "
+	    "world\n");
+    flagged = 1;
+  }
+
+  if (inventory && fclose(inventory) != 0) {
+    fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+    return 2;
+  }
+
+  printf("%d of %d shards, %ld keys, %ld exported, %ld skipped, "
+	 "%ld missing, %ld duplicated\n", ninputs, nshards,
+	 inputs[0].inv->worldkeys, exported, nskipped, missing, duplicated);
+
+  free(path);
+  free(listings);
+  free(seen);
+  for (i = 0; i < ninputs; i++) {
+    free(inputs[i].dir);
+    keyshard_free_inventory(inputs[i].inv);
+  }
+  free(inputs);
+
+  return flagged ? 1 : 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "keyshard.h"
+
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+  if (ok) {
+    printf("%s succeeded.\n", what);
+  } else {
+    printf("%s failed.\n", what);
+    failures++;
+  }
+}
+
+/* Every key must land in exactly one of count shards */
+static void partition(int count, const char *what)
+{
+  struct keyshard shard;
+  char ident[32];
+  int i, owners, ok = 1;
+
+  for (i = 0; i < 1000 && ok; i++) {
+    snprintf(ident, sizeof(ident), "ua%08x", i * 2654435761u);
+    owners = 0;
+    shard.count = count;
+    for (shard.index = 0; shard.index < count; shard.index++)
+      owners += keyshard_owns(&shard, "pkcs11", ident);
+    ok = owners == 1;
+  }
+  check(ok, what);
+}
+
+int main(int argc, char *argv[])
+{
+  struct keyshard shard;
+  struct keyshard_inventory *inv = NULL;
+  char path[] = "/tmp/testkeyshard.XXXXXX";
+  char pem[] = "key_pkcs11_uaabc.pem", jwk[] = "key_pkcs11_uaabc.jwk";
+  char *files[2];
+  FILE *f;
+  int fd;
+
+  /* Shard assignments must never change, or hosts on different
+     releases would disagree about them */
+  check(keyshard_hash("", "") == 0xcbf29ce484222325ULL * 0x100000001b3ULL,
+	"Hash of empty names");
+  check(keyshard_hash("pkcs11", "uaf0c15504eff737138a32527be52cf97ae50118a8")
+	== 0x907219bdb00d7a19ULL, "Hash of a PKCS#11 key");
+  check(keyshard_hash("ab", "c") != keyshard_hash("a", "bc"),
+	"Hash separates appname from ident");
+
+  check(keyshard_parse("2/4", &shard) == 0
+	&& shard.index == 2 && shard.count == 4, "Parsing 2/4");
+  check(keyshard_parse("0/1", &shard) == 0
+	&& shard.index == 0 && shard.count == 1, "Parsing 0/1");
+  check(keyshard_parse("4/4", &shard) != 0, "Rejecting 4/4");
+  check(keyshard_parse("-1/4", &shard) != 0, "Rejecting -1/4");
+  check(keyshard_parse("1/0", &shard) != 0, "Rejecting 1/0");
+  check(keyshard_parse("1", &shard) != 0, "Rejecting 1");
+  check(keyshard_parse("1/4x", &shard) != 0, "Rejecting 1/4x");
+
+  partition(1, "Partitioning over 1 shard");
+  partition(3, "Partitioning over 3 shards");
+  partition(16, "Partitioning over 16 shards");
+
+  /* Write an inventory and read it back */
+  files[0] = pem;
+  files[1] = jwk;
+  fd = mkstemp(path);
+  f = fd >= 0 ? fdopen(fd, "w") : NULL;
+  shard.index = 1;
+  shard.count = 3;
+  check(f != NULL
+	&& keyshard_write_header(f, &shard, 42, 0x0123456789abcdefULL) == 0
+	&& keyshard_write_entry(f, KEYSHARD_OK, "pkcs11", "uaabc",
+				files, 2) == 0
+	&& keyshard_write_entry(f, KEYSHARD_FAILED, "simple", "mykey",
+				NULL, 0) == 0
+	&& keyshard_write_entry(f, KEYSHARD_SKIPPED, "simple", "aeskey",
+				NULL, 0) == 0
+	&& fclose(f) == 0,
+	"Writing inventory");
+  check(keyshard_read_inventory(path, &inv) == 0
+	&& inv->shard.index == 1 && inv->shard.count == 3
+	&& inv->worldkeys == 42
+	&& inv->worlddigest == 0x0123456789abcdefULL
+	&& inv->nentries == 3
+	&& inv->entries[0].status == KEYSHARD_OK
+	&& strcmp(inv->entries[0].appname, "pkcs11") == 0
+	&& strcmp(inv->entries[0].ident, "uaabc") == 0
+	&& inv->entries[0].nfiles == 2
+	&& strcmp(inv->entries[0].files[1], files[1]) == 0
+	&& inv->entries[1].status == KEYSHARD_FAILED
+	&& strcmp(inv->entries[1].appname, "simple") == 0
+	&& inv->entries[1].nfiles == 0
+	&& inv->entries[2].status == KEYSHARD_SKIPPED
+	&& strcmp(inv->entries[2].ident, "aeskey") == 0,
+	"Reading inventory");
+  keyshard_free_inventory(inv);
+
+  /* Something that is not an inventory */
+  f = fopen(path, "w");
+  if (f) {
+    fputs("ok pkcs11 uaabc\n", f);
+    fclose(f);
+  }
+  inv = NULL;
+  check(keyshard_read_inventory(path, &inv) != 0 && inv == NULL,
+	"Rejecting file without header");
+  unlink(path);
+
+  return failures ? 1 : 0;
+}
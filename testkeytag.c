@@ -0,0 +1,117 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "keytag.h"
+
+/* A recognisable stand-in for an NFKM hash */
+static const unsigned char hash[KEYTAG_HASHLEN] = {
+  0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0x10, 0x32,
+  0x54, 0x76, 0x98, 0xba, 0xdc, 0xfe, 0xa5, 0x5a, 0xc3, 0x3c
+};
+
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+  if (ok) {
+    printf("%s succeeded.\n", what);
+  } else {
+    printf("%s failed.\n", what);
+    failures++;
+  }
+}
+
+/* Encode, decode and compare, for one version and value length */
+static void roundtrip(int version, int keytype, size_t len, int hashlen,
+		      const char *what)
+{
+  unsigned char buf[64];
+  struct keytag_info info;
+  BIGNUM *bn;
+
+  memset(&info, 0, sizeof(info));
+  check(keytag_encode(buf, len, version, keytype, hash) == 0
+	&& keytag_decode(buf, len, &info) == version
+	&& info.version == version
+	&& info.keytype == keytype
+	&& info.hashalg == KEYTAG_HASH_NFKM_SHA1
+	&& info.hashlen == hashlen
+	&& memcmp(info.hash, hash, hashlen) == 0,
+	what);
+
+  /* And the same through a BIGNUM, as a reader of the PEM file would */
+  memset(&info, 0, sizeof(info));
+  bn = BN_bin2bn(buf, len, NULL);
+  check(bn != NULL
+	&& keytag_decode_bn(bn, &info) == version
+	&& memcmp(info.hash, hash, hashlen) == 0,
+	"  ... via BIGNUM");
+  BN_free(bn);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned char buf[64];
+  struct keytag_info info;
+  size_t i;
+
+  roundtrip(KEYTAG_V1, KEYTAG_KEY_UNKNOWN, 32, KEYTAG_HASHLEN,
+	    "Version 1 tag, 32 bytes");
+  roundtrip(KEYTAG_V1, KEYTAG_KEY_UNKNOWN, 64, KEYTAG_HASHLEN,
+	    "Version 1 tag, 64 bytes");
+  roundtrip(KEYTAG_V2, KEYTAG_KEY_RSA, 64, KEYTAG_HASHLEN,
+	    "Version 2 RSA tag, 64 bytes");
+  roundtrip(KEYTAG_V2, KEYTAG_KEY_EC, 32, KEYTAG_HASHLEN,
+	    "Version 2 EC tag, 32 bytes");
+  roundtrip(KEYTAG_V2, KEYTAG_KEY_EC, 24, 18,
+	    "Version 2 EC tag, 24 bytes (P-192)");
+  roundtrip(KEYTAG_V2, KEYTAG_KEY_EC, KEYTAG_V2_MINLEN,
+	    KEYTAG_V2_MINHASHLEN, "Version 2 EC tag, minimum length");
+
+  check(keytag_encode(buf, 28, KEYTAG_V1, KEYTAG_KEY_EC, hash) != 0,
+	"Rejecting short version 1 tag");
+  check(keytag_encode(buf, KEYTAG_V2_MINLEN - 1, KEYTAG_V2,
+		      KEYTAG_KEY_EC, hash) != 0,
+	"Rejecting short version 2 tag");
+
+  /* Any single flipped byte in the header or hash must be caught */
+  keytag_encode(buf, 32, KEYTAG_V2, KEYTAG_KEY_DSA, hash);
+  for (i = 0; i < KEYTAG_V2_HEADERLEN + KEYTAG_HASHLEN; i++) {
+    buf[i] ^= 0x10;
+    if (keytag_decode(buf, 32, &info) != 0) break;
+    buf[i] ^= 0x10;
+  }
+  check(i == KEYTAG_V2_HEADERLEN + KEYTAG_HASHLEN,
+	"Detecting corrupted version 2 tag");
+
+  /* Something that is not a tag at all */
+  memset(buf, 0x5a, sizeof(buf));
+  check(keytag_decode(buf, sizeof(buf), &info) == 0,
+	"Rejecting random private value");
+
+  return failures ? 1 : 0;
+}
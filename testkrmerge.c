@@ -0,0 +1,222 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2014-2015 Sander Temme
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Runs krmerge over shard directories made up here, each with an
+ * inventory and a file per exported key, and checks that it accepts a
+ * complete set and flags what is missing or duplicated.  The krmerge
+ * to run is the first argument, ./krmerge by default.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "keyshard.h"
+
+#define NSHARDS 2
+#define NKEYS 8
+
+/* How to spoil a shard directory */
+#define SHARD_FAILED    1 /* Its first key failed to export */
+#define SHARD_DUPLICATE 2 /* It also exported a key of shard 0 */
+
+static int failures = 0;
+static const char *krmerge = "./krmerge";
+static char idents[NKEYS][16];
+static uint64_t worlddigest;
+
+static void check(int ok, const char *what)
+{
+  if (ok) {
+    printf("%s succeeded.\n", what);
+  } else {
+    printf("%s failed.\n", what);
+    failures++;
+  }
+}
+
+static int owner(int key)
+{
+  return keyshard_hash("pkcs11", idents[key]) % NSHARDS;
+}
+
+/* List a key in an inventory, writing its file if it was exported */
+static int write_key(FILE *inv, const char *dir, int key,
+		     enum keyshard_status status)
+{
+  char name[64], path[256];
+  char *files[1];
+  FILE *f;
+
+  if (status != KEYSHARD_OK)
+    return keyshard_write_entry(inv, status, "pkcs11", idents[key],
+				NULL, 0);
+  snprintf(name, sizeof(name), "key_pkcs11_%s.pem", idents[key]);
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  f = fopen(path, "w");
+  if (f == NULL) return -1;
+  fprintf(f, "%s\n", idents[key]);
+  if (fclose(f) != 0) return -1;
+  files[0] = name;
+  return keyshard_write_entry(inv, status, "pkcs11", idents[key], files, 1);
+}
+
+/* Make dir as shard index would have left it.  The world's last key
+   is the one without a public half. */
+static int write_shard(const char *dir, int index, int spoil)
+{
+  struct keyshard shard;
+  char path[256];
+  FILE *inv;
+  int key, first = 1, dup = 1, rc;
+
+  shard.index = index;
+  shard.count = NSHARDS;
+  snprintf(path, sizeof(path), "%s/%s", dir, KEYSHARD_INVENTORY);
+  if (mkdir(dir, 0777) != 0) return -1;
+  inv = fopen(path, "w");
+  if (inv == NULL) return -1;
+  rc = keyshard_write_header(inv, &shard, NKEYS, worlddigest);
+  for (key = 0; key < NKEYS && rc == 0; key++) {
+    if (owner(key) == index) {
+      if (key == NKEYS - 1)
+	rc = write_key(inv, dir, key, KEYSHARD_SKIPPED);
+      else if (first && (spoil & SHARD_FAILED))
+	rc = write_key(inv, dir, key, KEYSHARD_FAILED);
+      else
+	rc = write_key(inv, dir, key, KEYSHARD_OK);
+      first = 0;
+    } else if (dup && owner(key) == 0 && (spoil & SHARD_DUPLICATE)) {
+      rc = write_key(inv, dir, key, KEYSHARD_OK);
+      dup = 0;
+    }
+  }
+  if (fclose(inv) != 0) rc = -1;
+  return rc;
+}
+
+/* Run krmerge on up to four arguments, and return its exit status */
+static int run_krmerge(const char *a, const char *b, const char *c,
+		       const char *d)
+{
+  pid_t pid;
+  int status;
+
+  fflush(stdout);
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) {
+    /* krmerge's own reports would only clutter the test output */
+    if (freopen("/dev/null", "w", stdout) == NULL
+	|| freopen("/dev/null", "w", stderr) == NULL)
+      _exit(127);
+    execl(krmerge, krmerge, a, b, c, d, (char *)NULL);
+    _exit(127);
+  }
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) return -1;
+  return WEXITSTATUS(status);
+}
+
+int main(int argc, char *argv[])
+{
+  struct keyshard_inventory *inv = NULL;
+  char base[] = "/tmp/testkrmerge.XXXXXX";
+  char shard0[64], shard1[64], bad0[64], dup1[64], merged[64], path[256];
+  char cmd[128];
+  int i, counts[NSHARDS] = { 0 }, ok, skipped;
+
+  if (argc > 1) krmerge = argv[1];
+
+  /* A world with keys in every shard */
+  for (i = 0; i < NKEYS; i++) {
+    snprintf(idents[i], sizeof(idents[i]), "ua%08x", i * 2654435761u);
+    worlddigest += keyshard_hash("pkcs11", idents[i]);
+    counts[owner(i)]++;
+  }
+  check(counts[0] > 1 && counts[1] > 1, "Spreading keys over shards");
+
+  if (mkdtemp(base) == NULL) {
+    perror(base);
+    return 1;
+  }
+  snprintf(shard0, sizeof(shard0), "%s/shard0", base);
+  snprintf(shard1, sizeof(shard1), "%s/shard1", base);
+  snprintf(bad0, sizeof(bad0), "%s/bad0", base);
+  snprintf(dup1, sizeof(dup1), "%s/dup1", base);
+  snprintf(merged, sizeof(merged), "%s/merged", base);
+  check(write_shard(shard0, 0, 0) == 0
+	&& write_shard(shard1, 1, 0) == 0
+	&& write_shard(bad0, 0, SHARD_FAILED) == 0
+	&& write_shard(dup1, 1, SHARD_DUPLICATE) == 0,
+	"Writing shard directories");
+
+  /* A complete set, with one key skipped */
+  check(run_krmerge("-o", merged, shard0, shard1) == 0,
+	"Merging a complete set");
+  snprintf(path, sizeof(path), "%s/%s", merged, KEYSHARD_INVENTORY);
+  ok = skipped = 0;
+  if (keyshard_read_inventory(path, &inv) == 0) {
+    for (i = 0; i < inv->nentries; i++) {
+      if (inv->entries[i].status == KEYSHARD_OK) ok++;
+      if (inv->entries[i].status == KEYSHARD_SKIPPED) skipped++;
+    }
+    check(inv->shard.count == 1 && inv->worldkeys == NKEYS
+	  && inv->worlddigest == worlddigest && inv->nentries == NKEYS
+	  && ok == NKEYS - 1 && skipped == 1,
+	  "Reading merged inventory");
+    keyshard_free_inventory(inv);
+  } else {
+    check(0, "Reading merged inventory");
+  }
+  snprintf(path, sizeof(path), "%s/key_pkcs11_%s.pem", merged, idents[0]);
+  check(access(path, R_OK) == 0, "Finding merged key file");
+
+  check(run_krmerge(bad0, shard1, NULL, NULL) == 1,
+	"Flagging a failed key");
+  check(run_krmerge(shard0, dup1, NULL, NULL) == 1,
+	"Flagging a duplicated key");
+  check(run_krmerge(shard0, NULL, NULL, NULL) == 1,
+	"Flagging a missing shard");
+  check(run_krmerge(shard0, shard0, shard1, NULL) == 1,
+	"Flagging a shard given twice");
+
+  /* Merging into a shard directory would overwrite its inventory */
+  check(run_krmerge("-o", shard0, shard0, shard1) == 2,
+	"Refusing to merge into an input");
+  snprintf(path, sizeof(path), "%s/%s", shard0, KEYSHARD_INVENTORY);
+  inv = NULL;
+  check(keyshard_read_inventory(path, &inv) == 0
+	&& inv->shard.index == 0 && inv->shard.count == NSHARDS
+	&& inv->nentries == counts[0],
+	"Leaving the input inventory alone");
+  keyshard_free_inventory(inv);
+
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", base);
+  if (system(cmd) != 0) fprintf(stderr, "Error removing %s\n", base);
+
+  return failures ? 1 : 0;
+}